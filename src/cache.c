@@ -0,0 +1,369 @@
+/*
+ *  Copyright (C) 2006 Mike Melanson (mike at multimedia.cx)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*!
+ * \file cache.c
+ * \author Mike Melanson
+ * \brief Block cache.
+ *
+ * The cache is split into shards selected by a hash of the block
+ * number. Every shard has a fixed number of block slots, a hash table
+ * of chained slot indexes and a CLOCK hand; all of it is protected by
+ * the shard mutex. Blocks are read without holding any lock, so a slow
+ * read never blocks hits on the same shard.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cache.h"
+
+//! Number of shards, a power of two.
+#define BLOCK_CACHE_SHARDS 16
+
+//! Marks the end of a hash chain and a slot that holds no block.
+#define BLOCK_CACHE_NONE (-1)
+
+/*!
+ * \brief One slot of a cache shard.
+ */
+struct block_cache_slot {
+	//! Owner of the cached block, undefined for free slots.
+	const void *owner;
+	//! Number of the cached block, undefined for free slots.
+	off_t block;
+	//! Valid bytes of the block, BLOCK_CACHE_NONE for free slots.
+	ssize_t valid;
+	//! Next slot in the same hash chain.
+	int next;
+	//! CLOCK reference bit.
+	char referenced;
+};
+
+/*!
+ * \brief Independently locked part of the cache.
+ */
+struct block_cache_shard {
+	pthread_mutex_t lock;
+	//! Block slots.
+	struct block_cache_slot *slots;
+	//! Data of the slots, \c block_size bytes each.
+	char *data;
+	//! Number of \c slots.
+	int nslots;
+	//! Heads of the hash chains.
+	int *buckets;
+	//! Number of \c buckets, a power of two.
+	int nbuckets;
+	//! CLOCK hand.
+	int hand;
+};
+
+struct block_cache {
+	//! Size of one block.
+	size_t block_size;
+	//! log2 of \c block_size.
+	int block_shift;
+	//! Shards of the cache.
+	struct block_cache_shard shards[BLOCK_CACHE_SHARDS];
+	//! Number of blocks found in the cache.
+	unsigned long long hits;
+	//! Number of blocks read with the fill function.
+	unsigned long long misses;
+};
+
+//! Hash of a block.
+static inline unsigned int block_cache_hash(const void *owner, off_t block)
+{
+	uint64_t h = ((uint64_t)block ^ ((uint64_t)(uintptr_t)owner << 16)) *
+		0x9E3779B97F4A7C15ULL;
+
+	return h >> 32;
+}
+
+//! Get shard holding given block.
+static inline struct block_cache_shard *block_cache_shard(
+	struct block_cache *cache, const void *owner, off_t block)
+{
+	return &cache->shards[block_cache_hash(owner, block) &
+			      (BLOCK_CACHE_SHARDS - 1)];
+}
+
+//! Get head of the hash chain of given block.
+static inline int *block_cache_bucket(struct block_cache_shard *shard,
+				      const void *owner, off_t block)
+{
+	// the low bits selected the shard already
+	return &shard->buckets[(block_cache_hash(owner, block) /
+				BLOCK_CACHE_SHARDS) & (shard->nbuckets - 1)];
+}
+
+//! Find slot holding given block, the shard must be locked.
+static int block_cache_find(struct block_cache_shard *shard,
+			    const void *owner, off_t block)
+{
+	int i;
+
+	for (i = *block_cache_bucket(shard, owner, block);
+	     i != BLOCK_CACHE_NONE; i = shard->slots[i].next)
+		if (shard->slots[i].block == block &&
+		    shard->slots[i].owner == owner)
+			return i;
+
+	return BLOCK_CACHE_NONE;
+}
+
+//! Unlink slot from its hash chain and free it, the shard must be locked.
+static void block_cache_remove(struct block_cache_shard *shard, int i)
+{
+	struct block_cache_slot *slot = &shard->slots[i];
+	int *link;
+
+	for (link = block_cache_bucket(shard, slot->owner, slot->block);
+	     *link != i; link = &shard->slots[*link].next)
+		;
+	*link = slot->next;
+	slot->valid = BLOCK_CACHE_NONE;
+}
+
+/*!
+ * \brief Take a slot for a new block, the shard must be locked.
+ *
+ * Free slots are used first, then the CLOCK hand sweeps the slots,
+ * clearing reference bits, until it finds one not referenced since
+ * the last sweep. The evicted block is unlinked from its hash chain.
+ */
+static int block_cache_evict(struct block_cache_shard *shard)
+{
+	struct block_cache_slot *slot;
+	int i;
+
+	for (;;) {
+		i = shard->hand;
+		shard->hand = (shard->hand + 1) % shard->nslots;
+		slot = &shard->slots[i];
+		if (slot->valid == BLOCK_CACHE_NONE)
+			return i;
+		if (slot->referenced)
+			slot->referenced = 0;
+		else
+			break;
+	}
+
+	block_cache_remove(shard, i);
+
+	return i;
+}
+
+struct block_cache *block_cache_new(size_t capacity, size_t block_size)
+{
+	struct block_cache *cache;
+	struct block_cache_shard *shard;
+	int i, j, nslots;
+
+	if (!block_size || (block_size & (block_size - 1)))
+		return NULL;
+
+	cache = (struct block_cache *)calloc(1, sizeof(struct block_cache));
+	if (!cache)
+		return NULL;
+
+	cache->block_size = block_size;
+	while (((size_t)1 << cache->block_shift) < block_size)
+		cache->block_shift++;
+
+	nslots = capacity / block_size / BLOCK_CACHE_SHARDS;
+	if (nslots < 1)
+		nslots = 1;
+
+	for (i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->nslots = nslots;
+		shard->nbuckets = 1;
+		while (shard->nbuckets < nslots)
+			shard->nbuckets *= 2;
+		shard->slots = (struct block_cache_slot *)malloc(
+			nslots * sizeof(struct block_cache_slot));
+		shard->buckets = (int *)malloc(shard->nbuckets * sizeof(int));
+		shard->data = (char *)malloc((size_t)nslots * block_size);
+		if (!shard->slots || !shard->buckets || !shard->data) {
+			block_cache_free(cache);
+			return NULL;
+		}
+		for (j = 0; j < nslots; j++)
+			shard->slots[j].valid = BLOCK_CACHE_NONE;
+		for (j = 0; j < shard->nbuckets; j++)
+			shard->buckets[j] = BLOCK_CACHE_NONE;
+	}
+
+	return cache;
+}
+
+/*!
+ * \brief Copy part of a cached block, the shard must be locked.
+ *
+ * \return number of bytes copied.
+ */
+static size_t block_cache_copy(struct block_cache *cache,
+			       struct block_cache_shard *shard, int i,
+			       char *buf, size_t size, size_t within)
+{
+	struct block_cache_slot *slot = &shard->slots[i];
+
+	slot->referenced = 1;
+	if (within >= (size_t)slot->valid)
+		return 0;
+	if (size > slot->valid - within)
+		size = slot->valid - within;
+	memcpy(buf, shard->data + (size_t)i * cache->block_size + within, size);
+
+	return size;
+}
+
+ssize_t block_cache_read(struct block_cache *cache, void *buf, size_t size,
+			 off_t offset, block_cache_fill_t fill, void *data)
+{
+	struct block_cache_shard *shard;
+	size_t done = 0, within, want, got;
+	char *tmp = NULL, *target;
+	ssize_t valid, err = 0;
+	off_t block;
+	int i;
+
+	while (done < size) {
+		block = (offset + done) >> cache->block_shift;
+		within = (offset + done) & (cache->block_size - 1);
+		want = cache->block_size - within;
+		if (want > size - done)
+			want = size - done;
+		shard = block_cache_shard(cache, data, block);
+
+		pthread_mutex_lock(&shard->lock);
+		i = block_cache_find(shard, data, block);
+		if (i != BLOCK_CACHE_NONE) {
+			got = block_cache_copy(cache, shard, i,
+					       (char *)buf + done, want, within);
+			pthread_mutex_unlock(&shard->lock);
+			__atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+		} else {
+			pthread_mutex_unlock(&shard->lock);
+			__atomic_fetch_add(&cache->misses, 1, __ATOMIC_RELAXED);
+
+			// whole blocks are read straight into the caller's
+			// buffer, partial ones need a bounce buffer
+			if (!within && want == cache->block_size)
+				target = (char *)buf + done;
+			else {
+				if (!tmp)
+					tmp = (char *)malloc(cache->block_size);
+				if (!tmp) {
+					err = -ENOMEM;
+					break;
+				}
+				target = tmp;
+			}
+
+			valid = fill(data, target, cache->block_size,
+				     block << cache->block_shift);
+			if (valid < 0) {
+				err = valid;
+				break;
+			}
+
+			pthread_mutex_lock(&shard->lock);
+			// another thread may have inserted it meanwhile
+			if (block_cache_find(shard, data, block) ==
+			    BLOCK_CACHE_NONE) {
+				int *bucket;
+
+				i = block_cache_evict(shard);
+				bucket = block_cache_bucket(shard, data, block);
+				shard->slots[i].owner = data;
+				shard->slots[i].block = block;
+				shard->slots[i].valid = valid;
+				shard->slots[i].referenced = 0;
+				shard->slots[i].next = *bucket;
+				*bucket = i;
+				memcpy(shard->data + (size_t)i * cache->block_size,
+				       target, valid);
+			}
+			pthread_mutex_unlock(&shard->lock);
+
+			if (within >= (size_t)valid)
+				got = 0;
+			else {
+				got = valid - within;
+				if (got > want)
+					got = want;
+				if (target == tmp)
+					memcpy((char *)buf + done, tmp + within, got);
+			}
+		}
+
+		done += got;
+		if (got < want)
+			break;
+	}
+
+	free(tmp);
+
+	// errors are reported only if nothing could be read
+	return (done || !err) ? (ssize_t)done : err;
+}
+
+void block_cache_forget(struct block_cache *cache, const void *data)
+{
+	struct block_cache_shard *shard;
+	int i, j;
+
+	for (i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		for (j = 0; j < shard->nslots; j++)
+			if (shard->slots[j].valid != BLOCK_CACHE_NONE &&
+			    shard->slots[j].owner == data)
+				block_cache_remove(shard, j);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+void block_cache_stats(struct block_cache *cache,
+		       unsigned long long *hits, unsigned long long *misses)
+{
+	*hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+}
+
+void block_cache_free(struct block_cache *cache)
+{
+	int i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+		pthread_mutex_destroy(&cache->shards[i].lock);
+		free(cache->shards[i].slots);
+		free(cache->shards[i].buckets);
+		free(cache->shards[i].data);
+	}
+	free(cache);
+}
@@ -0,0 +1,110 @@
+/*
+ *  Copyright (C) 2006 Mike Melanson (mike at multimedia.cx)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*!
+ * \file cache.h
+ * \author Mike Melanson
+ * \brief Block cache header file.
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+struct block_cache;
+
+/*!
+ * \brief Function filling a block of the cache.
+ *
+ * \param data pointer given to \c block_cache_read().
+ * \param buf output buffer.
+ * \param size block size.
+ * \param offset offset of the block, a multiple of the block size.
+ * \return number of bytes read (less than \c size only at the end of
+ * the data) or -errno on error.
+ */
+typedef ssize_t (*block_cache_fill_t)(void *data, void *buf, size_t size,
+				      off_t offset);
+
+/*!
+ * \brief Create a block cache.
+ *
+ * The cache is split into shards with their own locks, so it can be
+ * used from many threads at once. Blocks are evicted with the CLOCK
+ * (second chance) algorithm.
+ *
+ * \param capacity size of cached data in bytes.
+ * \param block_size size of one block, a power of two.
+ * \return new cache or NULL on failure.
+ */
+struct block_cache *block_cache_new(size_t capacity, size_t block_size);
+
+/*!
+ * \brief Read through the cache.
+ *
+ * Blocks not in the cache are read with \c fill and inserted. Blocks
+ * are identified by \c data together with their offset, so one cache
+ * can be shared by many sources.
+ *
+ * \param cache cache to use.
+ * \param buf output buffer.
+ * \param size number of bytes to read.
+ * \param offset offset of the data.
+ * \param fill function reading missing blocks.
+ * \param data pointer passed to \c fill, identifies the source.
+ * \return number of bytes read (less than \c size only at the end of
+ * the data) or -errno on error.
+ */
+ssize_t block_cache_read(struct block_cache *cache, void *buf, size_t size,
+			 off_t offset, block_cache_fill_t fill, void *data);
+
+/*!
+ * \brief Drop all blocks of a source from the cache.
+ *
+ * This has to be done before the source goes away, as its \c data
+ * pointer may be reused by another one. No reads of the source may be
+ * in progress.
+ *
+ * \param cache cache to use.
+ * \param data source given to \c block_cache_read().
+ */
+void block_cache_forget(struct block_cache *cache, const void *data);
+
+/*!
+ * \brief Get hit and miss counters of the cache.
+ *
+ * \param cache cache to query.
+ * \param hits number of blocks found in the cache is stored here.
+ * \param misses number of blocks read with the fill function is
+ * stored here.
+ */
+void block_cache_stats(struct block_cache *cache,
+		       unsigned long long *hits, unsigned long long *misses);
+
+/*!
+ * \brief Free the cache and all cached blocks.
+ *
+ * \param cache cache to be freed, may be NULL.
+ */
+void block_cache_free(struct block_cache *cache);
+
+#endif				// _CACHE_H_
@@ -0,0 +1,442 @@
+/*
+ *  Copyright (C) 2006 Mike Melanson (mike at multimedia.cx)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*!
+ * \file cso.c
+ * \author Mike Melanson
+ * \brief Backend for block compressed (CSO and ZSO) images.
+ *
+ * The image is split into blocks of a fixed size, each compressed on
+ * its own, and an index after the header holds the file offset of
+ * every block (shifted right by the index shift), so any block can be
+ * read without touching the others. The top bit of an index entry
+ * tells how the block is stored:
+ *
+ * - CSO version 1: set for blocks stored uncompressed, others are raw
+ *   deflate streams.
+ * - CSO version 2: set for LZ4 blocks, others are deflate; blocks
+ *   taking a whole block size are stored uncompressed.
+ * - ZSO: set for blocks stored uncompressed, others are LZ4.
+ *
+ * Blocks taking no space at all read as zeros. Decompressed blocks are
+ * kept in a block cache, the image one if it has one.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "image.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+// size of the file header, the index follows it
+#define CSO_HEADER_SIZE 24
+
+// top bit of an index entry, its meaning depends on the format
+#define CSO_INDEX_FLAG 0x80000000u
+
+// size of the cache of decompressed blocks of images without a block
+// cache
+#define CSO_CACHE_SIZE (1024 * 1024)
+
+// largest block size that cache is used for; every one of its shards
+// takes a block at least, so larger blocks would exceed CSO_CACHE_SIZE
+#define CSO_CACHE_BLOCK_MAX (64 * 1024)
+
+// largest block size accepted
+#define CSO_BLOCK_MAX (16 * 1024 * 1024)
+
+//! Treat given memory address as a 32-bit little-endian integer.
+#define CSO_LE_32(x) ((uint32_t)(x)[0] | ((uint32_t)(x)[1] << 8) | \
+		      ((uint32_t)(x)[2] << 16) | ((uint32_t)(x)[3] << 24))
+
+enum cso_format {
+	CSO_V1,
+	CSO_V2,
+	CSO_ZSO,
+};
+
+enum cso_method {
+	CSO_PLAIN,
+	CSO_DEFLATE,
+	CSO_LZ4,
+};
+
+struct cso {
+	enum cso_format format;
+	//! Size of one decompressed block, a power of two.
+	uint32_t block_size;
+	//! Index entries are file offsets shifted right by this.
+	int shift;
+	//! Number of blocks.
+	uint32_t nblocks;
+	//! Index with \c nblocks + 1 entries, the last one is the end.
+	uint32_t *index;
+	//! Protects creation of \c cache.
+	pthread_mutex_t cache_lock;
+	//! Cache of decompressed blocks, NULL until the first read.
+	struct block_cache *cache;
+};
+
+#ifdef HAVE_ZLIB
+static pthread_key_t cso_zlib_key;
+static pthread_once_t cso_zlib_once = PTHREAD_ONCE_INIT;
+
+static void cso_zlib_destroy(void *data)
+{
+	inflateEnd((z_stream *)data);
+	free(data);
+}
+
+static void cso_zlib_init_key(void)
+{
+	pthread_key_create(&cso_zlib_key, cso_zlib_destroy);
+}
+
+// Every thread keeps its own inflate state, so blocks are decompressed
+// without locking and without allocating a window for every block.
+static int cso_inflate(const char *in, size_t len, char *out, size_t size)
+{
+	z_stream *z;
+	int ret;
+
+	pthread_once(&cso_zlib_once, cso_zlib_init_key);
+	z = (z_stream *)pthread_getspecific(cso_zlib_key);
+	if (!z) {
+		z = (z_stream *)calloc(1, sizeof(z_stream));
+		if (!z)
+			return -ENOMEM;
+		if (inflateInit2(z, -15) != Z_OK) {
+			free(z);
+			return -ENOMEM;
+		}
+		pthread_setspecific(cso_zlib_key, z);
+	} else
+		inflateReset(z);
+
+	z->next_in = (Bytef *)in;
+	z->avail_in = len;
+	z->next_out = (Bytef *)out;
+	z->avail_out = size;
+	ret = inflate(z, Z_FINISH);
+
+	// blocks may be padded after the end of the stream, but they must
+	// fill the whole block
+	if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR && ret != Z_OK) ||
+	    z->avail_out)
+		return -EIO;
+
+	return 0;
+}
+#endif
+
+// Decompress one block into out, which holds a whole block.
+static ssize_t cso_read_block(struct image *image, uint32_t block, char *out)
+{
+	struct cso *cso = (struct cso *)image->priv;
+	uint32_t entry = cso->index[block], next = cso->index[block + 1];
+	off_t pos = (off_t)(entry & ~CSO_INDEX_FLAG) << cso->shift;
+	off_t end = (off_t)(next & ~CSO_INDEX_FLAG) << cso->shift;
+	size_t size = cso->block_size, len;
+	enum cso_method method;
+	ssize_t ret;
+	char *in;
+
+	// the last block is short
+	if ((off_t)(block + 1) * cso->block_size > image->size)
+		size = image->size - (off_t)block * cso->block_size;
+
+	if (end < pos)
+		return -EIO;
+	len = end - pos;
+	if (!len) {
+		memset(out, 0, size);
+		return size;
+	}
+
+	switch (cso->format) {
+	case CSO_V1:
+		method = (entry & CSO_INDEX_FLAG) ? CSO_PLAIN : CSO_DEFLATE;
+		break;
+	case CSO_V2:
+		method = (entry & CSO_INDEX_FLAG) ? CSO_LZ4 :
+			(len >= cso->block_size) ? CSO_PLAIN : CSO_DEFLATE;
+		break;
+	default:
+		method = (entry & CSO_INDEX_FLAG) ? CSO_PLAIN : CSO_LZ4;
+		break;
+	}
+
+	if (method == CSO_PLAIN) {
+		ret = image_pread(image->fd, out, size, pos);
+		if (ret >= 0 && (size_t)ret < size)
+			ret = -EIO;
+		return ret;
+	}
+
+	in = (char *)malloc(len);
+	if (!in)
+		return -ENOMEM;
+	ret = image_pread(image->fd, in, len, pos);
+	if (ret >= 0 && (size_t)ret < len)
+		ret = -EIO;
+	if (ret >= 0) {
+		ret = -ENOTSUP;
+#ifdef HAVE_ZLIB
+		if (method == CSO_DEFLATE)
+			ret = cso_inflate(in, len, out, size);
+#endif
+#ifdef HAVE_LZ4
+		// padding after the block is not part of the LZ4 data, so
+		// decoding stops once the block is complete
+		if (method == CSO_LZ4)
+			ret = (LZ4_decompress_safe_partial(in, out, len, size,
+							   size) ==
+			       (int)size) ? 0 : -EIO;
+#endif
+		if (!ret)
+			ret = size;
+	}
+	free(in);
+
+	return ret;
+}
+
+// Fill function of the cache of decompressed blocks.
+static ssize_t cso_cache_fill(void *data, void *buf, size_t size,
+			      off_t offset)
+{
+	struct image *image = (struct image *)data;
+	struct cso *cso = (struct cso *)image->priv;
+
+	if (offset >= image->size)
+		return 0;
+
+	return cso_read_block(image, offset / cso->block_size, (char *)buf);
+}
+
+// Read blocks without caching them, for images with a block cache
+// (which keeps the decompressed data already).
+static ssize_t cso_read_direct(struct image *image, void *buf, size_t size,
+			       off_t offset)
+{
+	struct cso *cso = (struct cso *)image->priv;
+	size_t done = 0, within, want;
+	char *tmp = NULL, *target;
+	ssize_t ret = 0;
+	off_t pos;
+
+	while (done < size && offset + (off_t)done < image->size) {
+		pos = offset + done;
+		within = pos % cso->block_size;
+		want = cso->block_size - within;
+		if (want > size - done)
+			want = size - done;
+		if (want > image->size - pos)
+			want = image->size - pos;
+
+		// whole blocks are decompressed straight into the buffer
+		if (!within && (want == cso->block_size ||
+				pos + (off_t)want == image->size))
+			target = (char *)buf + done;
+		else {
+			if (!tmp)
+				tmp = (char *)malloc(cso->block_size);
+			if (!tmp) {
+				ret = -ENOMEM;
+				break;
+			}
+			target = tmp;
+		}
+
+		ret = cso_read_block(image, pos / cso->block_size, target);
+		if (ret < 0)
+			break;
+		if (target == tmp)
+			memcpy((char *)buf + done, tmp + within, want);
+		done += want;
+	}
+
+	free(tmp);
+
+	return (done || ret >= 0) ? (ssize_t)done : ret;
+}
+
+static int image_cso_probe(const unsigned char *header, size_t size)
+{
+	return size >= CSO_HEADER_SIZE && (!memcmp(header, "CISO", 4) ||
+					   !memcmp(header, "ZISO", 4));
+}
+
+static int image_cso_open(struct image *image)
+{
+	unsigned char header[CSO_HEADER_SIZE];
+	uint64_t total;
+	struct cso *cso;
+	size_t count, i;
+	ssize_t ret;
+
+	ret = image_pread(image->fd, header, sizeof(header), 0);
+	if (ret < 0)
+		return ret;
+	if (ret < (ssize_t)sizeof(header))
+		return -EINVAL;
+
+	cso = (struct cso *)calloc(1, sizeof(struct cso));
+	if (!cso)
+		return -ENOMEM;
+
+	total = CSO_LE_32(&header[8]) | (uint64_t)CSO_LE_32(&header[12]) << 32;
+	cso->block_size = CSO_LE_32(&header[16]);
+	cso->shift = header[21];
+	if (!memcmp(header, "ZISO", 4))
+		cso->format = CSO_ZSO;
+	else
+		cso->format = (header[20] >= 2) ? CSO_V2 : CSO_V1;
+
+	// the block size must suit the block cache
+	if (cso->block_size < 512 || cso->block_size > CSO_BLOCK_MAX ||
+	    (cso->block_size & (cso->block_size - 1)) || cso->shift > 31 ||
+	    total > (uint64_t)cso->block_size * UINT32_MAX) {
+		free(cso);
+		return -EINVAL;
+	}
+	cso->nblocks = (total + cso->block_size - 1) / cso->block_size;
+
+	// image->size is still the size of the file here
+	count = (size_t)cso->nblocks + 1;
+	if (CSO_HEADER_SIZE + (off_t)count * sizeof(uint32_t) > image->size) {
+		free(cso);
+		return -EINVAL;
+	}
+	cso->index = (uint32_t *)malloc(count * sizeof(uint32_t));
+	if (!cso->index) {
+		free(cso);
+		return -ENOMEM;
+	}
+	ret = image_pread(image->fd, cso->index, count * sizeof(uint32_t),
+			  CSO_HEADER_SIZE);
+	if (ret >= 0 && (size_t)ret < count * sizeof(uint32_t))
+		ret = -EINVAL;
+	if (ret < 0) {
+		free(cso->index);
+		free(cso);
+		return ret;
+	}
+	for (i = 0; i < count; i++)
+		cso->index[i] = CSO_LE_32((unsigned char *)&cso->index[i]);
+
+	pthread_mutex_init(&cso->cache_lock, NULL);
+	image->priv = cso;
+	image->size = total;
+
+	return 0;
+}
+
+static ssize_t image_cso_read(struct image *image, void *buf, size_t size,
+			      off_t offset)
+{
+	struct cso *cso = (struct cso *)image->priv;
+	struct block_cache *cache;
+
+	if (offset >= image->size)
+		return 0;
+
+	if (image->cache || cso->block_size > CSO_CACHE_BLOCK_MAX)
+		return cso_read_direct(image, buf, size, offset);
+
+	// reads smaller than a block would decompress it again and again
+	pthread_mutex_lock(&cso->cache_lock);
+	if (!cso->cache)
+		cso->cache = block_cache_new(CSO_CACHE_SIZE, cso->block_size);
+	cache = cso->cache;
+	pthread_mutex_unlock(&cso->cache_lock);
+
+	if (!cache)
+		return cso_read_direct(image, buf, size, offset);
+
+	return block_cache_read(cache, buf, size, offset, cso_cache_fill,
+				image);
+}
+
+static void image_cso_prefetch(struct image *image, off_t offset, off_t size)
+{
+	struct cso *cso = (struct cso *)image->priv;
+	uint32_t first, last;
+	off_t from, to;
+
+	if (offset >= image->size || size <= 0)
+		return;
+	if (offset + size > image->size)
+		size = image->size - offset;
+
+	// the compressed blocks of an extent are contiguous in the file
+	first = offset / cso->block_size;
+	last = (offset + size - 1) / cso->block_size;
+	from = (off_t)(cso->index[first] & ~CSO_INDEX_FLAG) << cso->shift;
+	to = (off_t)(cso->index[last + 1] & ~CSO_INDEX_FLAG) << cso->shift;
+	if (to > from)
+		posix_fadvise(image->fd, from, to - from, POSIX_FADV_WILLNEED);
+}
+
+static size_t image_cso_memory(struct image *image)
+{
+	struct cso *cso = (struct cso *)image->priv;
+	size_t size;
+
+	size = sizeof(struct cso) + ((size_t)cso->nblocks + 1) *
+		sizeof(uint32_t);
+	pthread_mutex_lock(&cso->cache_lock);
+	if (cso->cache)
+		size += CSO_CACHE_SIZE;
+	pthread_mutex_unlock(&cso->cache_lock);
+
+	return size;
+}
+
+static void image_cso_close(struct image *image)
+{
+	struct cso *cso = (struct cso *)image->priv;
+
+	block_cache_free(cso->cache);
+	pthread_mutex_destroy(&cso->cache_lock);
+	free(cso->index);
+	free(cso);
+}
+
+const struct image_backend image_cso_backend = {
+	.name = "cso",
+	.probe = image_cso_probe,
+	.open = image_cso_open,
+	.read = image_cso_read,
+	.prefetch = image_cso_prefetch,
+	.memory = image_cso_memory,
+	.close = image_cso_close,
+};
@@ -0,0 +1,639 @@
+/*
+ *  Copyright (C) 2006 Mike Melanson (mike at multimedia.cx)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*!
+ * \file image.c
+ * \author Mike Melanson
+ * \brief Disc image access backends.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+//! This is needed for copy_file_range.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// files up to this size are prefetched as a whole when opened through
+// the mmap backend, larger ones are just marked sequential
+#define MMAP_WILLNEED_MAX (1024 * 1024)
+
+// **********************************************************************
+// fd backend: positional reads on the image file descriptor
+// **********************************************************************
+
+ssize_t image_pread(int fd, void *buf, size_t size, off_t offset)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	// Positional reads don't touch the shared seek pointer of fd,
+	// so any number of threads can read concurrently.
+	while (done < size) {
+		ret = pread(fd, (char *)buf + done, size - done,
+			    offset + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+static ssize_t image_fd_read(struct image *image, void *buf, size_t size,
+			     off_t offset)
+{
+	return image_pread(image->fd, buf, size, offset);
+}
+
+static void image_fd_prefetch(struct image *image, off_t offset, off_t size)
+{
+	// makes the kernel start reading into the page cache without
+	// waiting for it, later preads are then served from memory
+	posix_fadvise(image->fd, offset, size, POSIX_FADV_WILLNEED);
+}
+
+static const struct image_backend image_fd_backend = {
+	.name = "fd",
+	.raw = 1,
+	.read = image_fd_read,
+	.prefetch = image_fd_prefetch,
+};
+
+// **********************************************************************
+// mmap backend: the whole image is mapped, reads are plain copies
+// **********************************************************************
+
+static int image_mmap_open(struct image *image)
+{
+	void *map;
+
+	if (image->size <= 0 || (uint64_t)image->size > SIZE_MAX)
+		return -EFBIG;
+
+	map = mmap(NULL, image->size, PROT_READ, MAP_SHARED, image->fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	// accesses are driven by FUSE requests, don't let the kernel
+	// read around every fault; extents get their own hints when
+	// files are opened
+	madvise(map, image->size, MADV_RANDOM);
+
+	image->priv = map;
+
+	return 0;
+}
+
+static ssize_t image_mmap_read(struct image *image, void *buf, size_t size,
+			       off_t offset)
+{
+	if (offset >= image->size)
+		return 0;
+	if (offset + size > image->size)
+		size = image->size - offset;
+
+	memcpy(buf, (char *)image->priv + offset, size);
+
+	return size;
+}
+
+static void image_mmap_advise(struct image *image, off_t offset, off_t size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	off_t start = offset & ~(off_t)(page - 1);
+
+	if (offset >= image->size)
+		return;
+	if (offset + size > image->size)
+		size = image->size - offset;
+
+	madvise((char *)image->priv + start, size + (offset - start),
+		(size <= MMAP_WILLNEED_MAX) ? MADV_WILLNEED : MADV_SEQUENTIAL);
+}
+
+static void image_mmap_prefetch(struct image *image, off_t offset,
+				off_t size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	off_t start = offset & ~(off_t)(page - 1);
+
+	if (offset >= image->size)
+		return;
+	if (offset + size > image->size)
+		size = image->size - offset;
+
+	madvise((char *)image->priv + start, size + (offset - start),
+		MADV_WILLNEED);
+}
+
+static void image_mmap_close(struct image *image)
+{
+	munmap(image->priv, image->size);
+}
+
+static const struct image_backend image_mmap_backend = {
+	.name = "mmap",
+	.raw = 1,
+	.open = image_mmap_open,
+	.read = image_mmap_read,
+	.advise = image_mmap_advise,
+	.prefetch = image_mmap_prefetch,
+	.close = image_mmap_close,
+};
+
+#ifdef HAVE_LIBURING
+// **********************************************************************
+// uring backend: reads are split and submitted through io_uring
+// **********************************************************************
+
+// submission queue size of the per-thread rings, also the most chunks
+// of one read that are in flight at once; at most 64, as chunks in
+// flight are tracked in a 64-bit mask
+#define URING_ENTRIES 64
+
+// reads are split into chunks of this size, each one an SQE
+#define URING_CHUNK (128 * 1024)
+
+static pthread_key_t image_uring_key;
+static pthread_once_t image_uring_once = PTHREAD_ONCE_INIT;
+
+static void image_uring_destroy(void *data)
+{
+	io_uring_queue_exit((struct io_uring *)data);
+	free(data);
+}
+
+static void image_uring_init_key(void)
+{
+	pthread_key_create(&image_uring_key, image_uring_destroy);
+}
+
+// Every thread gets its own ring, so FUSE worker threads submit and
+// reap without any locking; the rings are freed when threads exit.
+static int image_uring_get(struct io_uring **ring)
+{
+	int ret;
+
+	*ring = (struct io_uring *)pthread_getspecific(image_uring_key);
+	if (*ring)
+		return 0;
+
+	*ring = (struct io_uring *)malloc(sizeof(struct io_uring));
+	if (!*ring)
+		return -ENOMEM;
+
+	ret = io_uring_queue_init(URING_ENTRIES, *ring, 0);
+	if (ret < 0) {
+		free(*ring);
+		*ring = NULL;
+		return ret;
+	}
+	pthread_setspecific(image_uring_key, *ring);
+
+	return 0;
+}
+
+static int image_uring_open(struct image *image)
+{
+	struct io_uring *ring;
+
+	pthread_once(&image_uring_once, image_uring_init_key);
+
+	// fails when the kernel has no io_uring (or it is filtered), the
+	// image then falls back to the fd backend
+	return image_uring_get(&ring);
+}
+
+// Drop the ring of the calling thread after an error, anything still
+// queued in it is discarded.
+static void image_uring_drop(struct io_uring *ring)
+{
+	pthread_setspecific(image_uring_key, NULL);
+	image_uring_destroy(ring);
+}
+
+// user_data of cancel requests, which never matches a chunk
+#define URING_CANCEL UINTPTR_MAX
+
+// Cancel the reads still in flight and wait for all of them to finish,
+// as they write into the caller's buffer. Bit i of pending is set for
+// the chunk at base + i * URING_CHUNK, which has not been reaped yet.
+static void image_uring_abort(struct io_uring *ring, uint64_t pending,
+			      size_t base)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	uintptr_t pos;
+	int i;
+
+	// the reads just complete if this can't be submitted
+	for (i = 0; i < URING_ENTRIES; i++) {
+		if (!(pending & (1ULL << i)) || !(sqe = io_uring_get_sqe(ring)))
+			continue;
+		io_uring_prep_cancel(sqe, (void *)(uintptr_t)
+				     (base + (size_t)i * URING_CHUNK), 0);
+		io_uring_sqe_set_data(sqe, (void *)URING_CANCEL);
+	}
+	io_uring_submit(ring);
+
+	while (pending) {
+		// there is nothing else to do than to wait for them
+		if (io_uring_wait_cqe(ring, &cqe) < 0) {
+			usleep(1000);
+			continue;
+		}
+		pos = (uintptr_t)io_uring_cqe_get_data(cqe);
+		if (pos != URING_CANCEL)
+			pending &= ~(1ULL << ((pos - base) / URING_CHUNK));
+		io_uring_cqe_seen(ring, cqe);
+	}
+}
+
+static ssize_t image_uring_read(struct image *image, void *buf, size_t size,
+				off_t offset)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct io_uring *ring;
+	size_t done = 0, end, pos, len, got;
+	int queued, submitted, reaped;
+	uint64_t pending;
+	ssize_t ret = 0, res;
+
+	if (image_uring_get(&ring))
+		return image_fd_read(image, buf, size, offset);
+
+	// the image never changes, so nothing past its end needs to be
+	// submitted at all
+	if (offset >= image->size)
+		return 0;
+	if (offset + size > image->size)
+		size = image->size - offset;
+
+	while (done < size) {
+		// one batch of up to URING_ENTRIES chunks
+		for (end = done, queued = 0; end < size && queued < URING_ENTRIES;
+		     end += len, queued++) {
+			len = size - end;
+			if (len > URING_CHUNK)
+				len = URING_CHUNK;
+			sqe = io_uring_get_sqe(ring);
+			io_uring_prep_read(sqe, image->fd, (char *)buf + end,
+					   len, offset + end);
+			io_uring_sqe_set_data(sqe, (void *)(uintptr_t)end);
+		}
+
+		for (submitted = 0; submitted < queued; submitted += res) {
+			res = io_uring_submit(ring);
+			if (res <= 0) {
+				ret = res ? res : -EIO;
+				break;
+			}
+		}
+
+		// everything submitted has to be reaped before returning,
+		// as it writes into buf
+		pending = (submitted < 64) ? (1ULL << submitted) - 1 : ~0ULL;
+		for (reaped = 0; reaped < submitted; reaped++) {
+			while ((res = io_uring_wait_cqe(ring, &cqe)) == -EINTR)
+				;
+			if (res < 0) {
+				image_uring_abort(ring, pending, done);
+				image_uring_drop(ring);
+				return res;
+			}
+
+			pos = (uintptr_t)io_uring_cqe_get_data(cqe);
+			pending &= ~(1ULL << ((pos - done) / URING_CHUNK));
+			len = size - pos;
+			if (len > URING_CHUNK)
+				len = URING_CHUNK;
+			got = (cqe->res > 0) ? cqe->res : 0;
+			io_uring_cqe_seen(ring, cqe);
+
+			// short or failed chunks (e.g. -EAGAIN) are finished
+			// synchronously
+			if (got < len && !ret) {
+				res = image_fd_read(image, (char *)buf + pos + got,
+						    len - got, offset + pos + got);
+				if (res < 0)
+					ret = res;
+				else if (got + res < len)
+					ret = -EIO;
+			}
+		}
+
+		if (ret) {
+			if (submitted < queued)
+				image_uring_drop(ring);
+			return ret;
+		}
+		done = end;
+	}
+
+	return done;
+}
+
+static const struct image_backend image_uring_backend = {
+	.name = "uring",
+	.raw = 1,
+	.open = image_uring_open,
+	.read = image_uring_read,
+	.prefetch = image_fd_prefetch,
+};
+#endif
+
+// **********************************************************************
+// Generic image functions
+// **********************************************************************
+
+//! All backends, the first one is the default.
+static const struct image_backend *image_backends[] = {
+	&image_fd_backend,
+	&image_mmap_backend,
+#ifdef HAVE_LIBURING
+	&image_uring_backend,
+#endif
+	&image_cso_backend,
+	&image_trim_backend,
+#ifdef HAVE_ZSTD
+	&image_zstdseek_backend,
+#endif
+	NULL
+};
+
+const struct image_backend *image_probe(int fd)
+{
+	unsigned char header[IMAGE_PROBE_SIZE];
+	ssize_t size;
+	int i;
+
+	size = image_pread(fd, header, sizeof(header), 0);
+	if (size <= 0)
+		return NULL;
+
+	for (i = 0; image_backends[i]; i++)
+		if (image_backends[i]->probe &&
+		    image_backends[i]->probe(header, size))
+			return image_backends[i];
+
+	return NULL;
+}
+
+struct image *image_open(int fd, const char *backend)
+{
+	const struct image_backend *format;
+	struct image *image;
+	struct stat st;
+	int i, ret;
+
+	image = (struct image *)malloc(sizeof(struct image));
+	if (!image) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	image->backend = image_backends[0];
+	if (backend) {
+		for (i = 0; image_backends[i]; i++)
+			if (!strcmp(image_backends[i]->name, backend))
+				break;
+		if (!image_backends[i]) {
+			fprintf(stderr, "unknown image backend: %s\n", backend);
+			close(fd);
+			free(image);
+			errno = EINVAL;
+			return NULL;
+		}
+		image->backend = image_backends[i];
+	}
+
+	image->fd = fd;
+	image->priv = NULL;
+	image->cache = NULL;
+	if (fstat(fd, &st) < 0) {
+		ret = errno;
+		close(fd);
+		free(image);
+		errno = ret;
+		return NULL;
+	}
+	image->size = st.st_size;
+
+	// the contents of container formats can't be read any other way
+	format = image_probe(fd);
+	if (format) {
+		if (backend && strcmp(backend, format->name))
+			fprintf(stderr, "%s image, ignoring %s backend\n",
+				format->name, backend);
+		image->backend = format;
+		ret = format->open(image);
+		if (ret) {
+			fprintf(stderr, "%s image: %s\n", format->name,
+				strerror(-ret));
+			close(fd);
+			free(image);
+			errno = -ret;
+			return NULL;
+		}
+		return image;
+	}
+
+	if (image->backend->open && (ret = image->backend->open(image))) {
+		fprintf(stderr, "%s backend: %s, falling back to %s\n",
+			image->backend->name, strerror(-ret),
+			image_backends[0]->name);
+		image->backend = image_backends[0];
+		image->priv = NULL;
+	}
+
+	return image;
+}
+
+//! Fill function of the image block cache.
+static ssize_t image_cache_fill(void *data, void *buf, size_t size,
+				off_t offset)
+{
+	struct image *image = (struct image *)data;
+
+	return image->backend->read(image, buf, size, offset);
+}
+
+void image_set_cache(struct image *image, struct block_cache *cache)
+{
+	image->cache = cache;
+}
+
+ssize_t image_cached_read(struct image *image, void *buf, size_t size,
+			  off_t offset)
+{
+	return block_cache_read(image->cache, buf, size, offset,
+				image_cache_fill, image);
+}
+
+void image_readahead_init(struct image_readahead *ra, off_t offset,
+			  off_t size)
+{
+	pthread_mutex_init(&ra->lock, NULL);
+	ra->next = offset;
+	ra->ahead = offset;
+	ra->window = 0;
+	ra->end = offset + size;
+}
+
+void image_readahead(struct image *image, struct image_readahead *ra,
+		     off_t offset, size_t size)
+{
+	off_t from = 0, to = 0;
+
+	if (!image->backend->prefetch)
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	if (offset == ra->next) {
+		if (ra->ahead < offset + (off_t)size)
+			ra->ahead = offset + size;
+		// the reader got close to the end of the prefetched data,
+		// request the next, larger window
+		if (ra->ahead - (offset + (off_t)size) <= ra->window / 2 &&
+		    ra->ahead < ra->end) {
+			ra->window = ra->window ? ra->window * 2 :
+				IMAGE_READAHEAD_MIN;
+			if (ra->window > IMAGE_READAHEAD_MAX)
+				ra->window = IMAGE_READAHEAD_MAX;
+			from = ra->ahead;
+			to = from + ra->window;
+			if (to > ra->end)
+				to = ra->end;
+			ra->ahead = to;
+		}
+	} else {
+		ra->window = 0;
+		ra->ahead = offset + size;
+	}
+	ra->next = offset + size;
+	pthread_mutex_unlock(&ra->lock);
+
+	if (to > from)
+		image_prefetch(image, from, to - from);
+}
+
+void image_readahead_destroy(struct image_readahead *ra)
+{
+	pthread_mutex_destroy(&ra->lock);
+}
+
+int image_pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = pwrite(fd, buf, size, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret < 0 ? -errno : -EIO;
+		buf = (const char *)buf + ret;
+		size -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+int image_copy(struct image *image, off_t offset, off_t size, int fd,
+	       off_t pos, char **buf)
+{
+	ssize_t ret;
+	size_t want;
+#ifdef HAVE_COPY_FILE_RANGE
+	off_t from;
+	int in;
+
+	// the kernel copies (or even shares) the data of plain images
+	// without passing them through user space; whatever it can't
+	// copy is read the usual way
+	in = image_splice_fd(image, offset, size, &from);
+	while (in >= 0 && size > 0) {
+		ret = copy_file_range(in, &from, fd, &pos, size, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		offset += ret;
+		size -= ret;
+	}
+	if (!size)
+		return 0;
+#endif
+
+	if (!*buf && !(*buf = (char *)malloc(IMAGE_COPY_SIZE)))
+		return -ENOMEM;
+
+	while (size > 0) {
+		want = (size < IMAGE_COPY_SIZE) ? size : IMAGE_COPY_SIZE;
+		ret = image_read(image, *buf, want, offset);
+		if (ret >= 0 && (size_t)ret < want)
+			ret = -EIO;
+		if (ret < 0)
+			return ret;
+		ret = image_pwrite(fd, *buf, want, pos);
+		if (ret)
+			return ret;
+		offset += want;
+		pos += want;
+		size -= want;
+	}
+
+	return 0;
+}
+
+void image_close(struct image *image)
+{
+	if (!image)
+		return;
+
+	if (image->cache)
+		block_cache_forget(image->cache, image);
+
+	if (image->backend->close)
+		image->backend->close(image);
+	close(image->fd);
+	free(image);
+}
@@ -0,0 +1,439 @@
+/*
+ *  Copyright (C) 2006 Mike Melanson (mike at multimedia.cx)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*!
+ * \file image.h
+ * \author Mike Melanson
+ * \brief Disc image access backends header file.
+ */
+
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+//! Size of blocks cached by the image block cache (32 sectors).
+#define IMAGE_CACHE_BLOCK_SIZE (64 * 1024)
+
+//! Initial read-ahead window of a sequentially read extent.
+#define IMAGE_READAHEAD_MIN (128 * 1024)
+
+//! Largest read-ahead window.
+#define IMAGE_READAHEAD_MAX (8 * 1024 * 1024)
+
+//! Number of bytes at the start of the image given to backend probes.
+#define IMAGE_PROBE_SIZE 64
+
+//! Size of the buffer of \c image_copy().
+#define IMAGE_COPY_SIZE (1024 * 1024)
+
+struct image;
+
+/*!
+ * \brief Image backend operations.
+ *
+ * A backend implements access to the bytes of a disc image. All
+ * operations except \c open and \c close may be called from many
+ * threads at once.
+ */
+struct image_backend {
+	/*!
+	 * \brief Backend name, as selected with "-o backend=".
+	 */
+	const char *name;
+
+	/*!
+	 * \brief Flag indicating that reads return the bytes of the image
+	 * file at the same offsets, so its fd may be read directly.
+	 */
+	int raw;
+
+	/*!
+	 * \brief Check if the image file is in the format of this backend.
+	 *
+	 * Backends of container formats (e.g. compressed images) are
+	 * selected by this automatically, whatever backend was asked
+	 * for. May be NULL.
+	 *
+	 * \param header first bytes of the image file.
+	 * \param size number of bytes in \c header, may be less than
+	 * \c IMAGE_PROBE_SIZE for small files.
+	 * \return nonzero if the backend should be used.
+	 */
+	int (*probe)(const unsigned char *header, size_t size);
+
+	/*!
+	 * \brief Prepare backend for use.
+	 *
+	 * \c image->fd and \c image->size are already set; backends
+	 * of container formats set \c image->size to the size of the
+	 * contents.
+	 * \return 0 on success, -errno otherwise.
+	 */
+	int (*open)(struct image *image);
+
+	/*!
+	 * \brief Read bytes from the image.
+	 *
+	 * \return number of bytes read (less than \c size only at the end
+	 * of the image) or -errno on error.
+	 */
+	ssize_t (*read)(struct image *image, void *buf, size_t size,
+			off_t offset);
+
+	/*!
+	 * \brief Find where an extent of the image is stored in the image
+	 * file.
+	 *
+	 * This is for backends of container formats which store the
+	 * contents uncompressed, just at other offsets, so that they can
+	 * be spliced from the image file too. May be NULL.
+	 *
+	 * \param pos offset of the extent in the image file is stored
+	 * here.
+	 * \return 0 if all \c size bytes at \c offset are stored at
+	 * \c *pos, -1 otherwise.
+	 */
+	int (*map)(struct image *image, off_t offset, size_t size, off_t *pos);
+
+	/*!
+	 * \brief Hint that given extent of the image is about to be read.
+	 *
+	 * May be NULL.
+	 */
+	void (*advise)(struct image *image, off_t offset, off_t size);
+
+	/*!
+	 * \brief Start reading given extent of the image in background.
+	 *
+	 * Must not wait for the data. May be NULL.
+	 */
+	void (*prefetch)(struct image *image, off_t offset, off_t size);
+
+	/*!
+	 * \brief Get memory allocated by the backend for the image.
+	 *
+	 * May be NULL.
+	 */
+	size_t (*memory)(struct image *image);
+
+	/*!
+	 * \brief Release everything allocated by \c open.
+	 *
+	 * May be NULL.
+	 */
+	void (*close)(struct image *image);
+};
+
+/*!
+ * \brief Opened disc image.
+ */
+struct image {
+	/*!
+	 * \brief Backend used to access the image.
+	 */
+	const struct image_backend *backend;
+
+	/*!
+	 * \brief File descriptor of the image file.
+	 */
+	int fd;
+
+	/*!
+	 * \brief Size of the image, as read through the backend.
+	 */
+	off_t size;
+
+	/*!
+	 * \brief Backend private data.
+	 */
+	void *priv;
+
+	/*!
+	 * \brief Block cache in front of the backend, NULL if disabled.
+	 *
+	 * It may be shared with other images and is not owned by this one.
+	 */
+	struct block_cache *cache;
+};
+
+/*!
+ * \brief Read-ahead state of one sequentially read extent.
+ *
+ * This is kept per open file. Reads continuing where the previous one
+ * ended are sequential; each time they get within half a window of
+ * the data already requested, the next window is prefetched and the
+ * window doubles (up to \c IMAGE_READAHEAD_MAX). Any other read
+ * resets it.
+ */
+struct image_readahead {
+	/*!
+	 * \brief Protects the fields below, reads may be concurrent.
+	 */
+	pthread_mutex_t lock;
+
+	/*!
+	 * \brief Offset where the next sequential read starts.
+	 */
+	off_t next;
+
+	/*!
+	 * \brief End of the data already prefetched.
+	 */
+	off_t ahead;
+
+	/*!
+	 * \brief Current window size, 0 after a non-sequential read.
+	 */
+	off_t window;
+
+	/*!
+	 * \brief End of the extent, nothing past it is prefetched.
+	 */
+	off_t end;
+};
+
+//! Backend of CSO and ZSO block compressed images, see cso.c.
+extern const struct image_backend image_cso_backend;
+
+//! Backend of trimmed images, see trim.c.
+extern const struct image_backend image_trim_backend;
+
+#ifdef HAVE_ZSTD
+//! Backend of seekable zstd images, see zstdseek.c.
+extern const struct image_backend image_zstdseek_backend;
+#endif
+
+/*!
+ * \brief Read from a file descriptor until \c size bytes or the end of
+ * the file, retrying interrupted and short reads.
+ *
+ * \return number of bytes read or -errno on error.
+ */
+ssize_t image_pread(int fd, void *buf, size_t size, off_t offset);
+
+/*!
+ * \brief Write whole buffer to a file descriptor, retrying interrupted
+ * and short writes.
+ *
+ * \return 0 on success or -errno on error.
+ */
+int image_pwrite(int fd, const void *buf, size_t size, off_t offset);
+
+/*!
+ * \brief Find backend of the container format an image file is in.
+ *
+ * \param fd file descriptor of the image file.
+ * \return backend or NULL if the file is in no container format (it may
+ * still be a plain image).
+ */
+const struct image_backend *image_probe(int fd);
+
+/*!
+ * \brief Open disc image using given backend.
+ *
+ * Compressed images are recognized and opened with their own backend
+ * instead.
+ *
+ * \param fd file descriptor of the image file; it is owned by the
+ * image afterwards (also on failure).
+ * \param backend name of the backend, NULL for the default one.
+ * \return new image or NULL on failure (errno is set).
+ */
+struct image *image_open(int fd, const char *backend);
+
+/*!
+ * \brief Put a block cache in front of the image backend.
+ *
+ * \param image image to be cached.
+ * \param cache cache created with \c IMAGE_CACHE_BLOCK_SIZE blocks; it
+ * may be shared by many images and has to outlive them.
+ */
+void image_set_cache(struct image *image, struct block_cache *cache);
+
+/*!
+ * \brief Read bytes from the image through its block cache.
+ *
+ * Use \c image_read() instead.
+ */
+ssize_t image_cached_read(struct image *image, void *buf, size_t size,
+			  off_t offset);
+
+/*!
+ * \brief Read bytes from the image.
+ *
+ * \param image image to read from.
+ * \param buf output buffer.
+ * \param size number of bytes to read.
+ * \param offset absolute offset in the image.
+ * \return number of bytes read (less than \c size only at the end of
+ * the image) or -errno on error.
+ */
+static inline ssize_t image_read(struct image *image, void *buf,
+				 size_t size, off_t offset)
+{
+	if (image->cache)
+		return image_cached_read(image, buf, size, offset);
+
+	return image->backend->read(image, buf, size, offset);
+}
+
+/*!
+ * \brief Get file descriptor an extent of the image can be spliced
+ * from.
+ *
+ * Data read from it at \c *pos are the same as \c image_read() would
+ * return for the extent, but no cached copy is bypassed.
+ *
+ * \param image image to be read.
+ * \param offset absolute offset of the extent in the image.
+ * \param size size of the extent.
+ * \param pos offset of the extent in the file is stored here.
+ * \return file descriptor or -1 if the extent has to be read with
+ * \c image_read().
+ */
+static inline int image_splice_fd(struct image *image, off_t offset,
+				  size_t size, off_t *pos)
+{
+	if (image->cache)
+		return -1;
+
+	if (image->backend->raw) {
+		*pos = offset;
+		return image->fd;
+	}
+
+	if (image->backend->map &&
+	    !image->backend->map(image, offset, size, pos))
+		return image->fd;
+
+	return -1;
+}
+
+/*!
+ * \brief Hint that given extent of the image is about to be read.
+ *
+ * \param image image the extent belongs to.
+ * \param offset absolute offset of the extent.
+ * \param size size of the extent.
+ */
+static inline void image_advise(struct image *image, off_t offset,
+				off_t size)
+{
+	if (image->backend->advise)
+		image->backend->advise(image, offset, size);
+}
+
+/*!
+ * \brief Start reading given extent of the image in background.
+ *
+ * \param image image the extent belongs to.
+ * \param offset absolute offset of the extent.
+ * \param size size of the extent.
+ */
+static inline void image_prefetch(struct image *image, off_t offset,
+				  off_t size)
+{
+	if (image->backend->prefetch)
+		image->backend->prefetch(image, offset, size);
+}
+
+/*!
+ * \brief Get memory allocated for an image, e.g. for its index and
+ * decompressed data.
+ *
+ * Memory of a shared block cache is not included.
+ *
+ * \param image image to query.
+ * \return size in bytes.
+ */
+static inline size_t image_memory(struct image *image)
+{
+	if (image->backend->memory)
+		return image->backend->memory(image);
+
+	return 0;
+}
+
+/*!
+ * \brief Initialize read-ahead state of an extent.
+ *
+ * \param ra state to initialize.
+ * \param offset absolute offset of the extent; reading from its start
+ * counts as sequential.
+ * \param size size of the extent.
+ */
+void image_readahead_init(struct image_readahead *ra, off_t offset,
+			  off_t size);
+
+/*!
+ * \brief Account a read of the extent and prefetch ahead of it.
+ *
+ * Should be called before the data is read.
+ *
+ * \param image image the extent belongs to.
+ * \param ra read-ahead state of the extent.
+ * \param offset absolute offset of the read.
+ * \param size size of the read.
+ */
+void image_readahead(struct image *image, struct image_readahead *ra,
+		     off_t offset, size_t size);
+
+/*!
+ * \brief Free read-ahead state of an extent.
+ *
+ * \param ra state to free.
+ */
+void image_readahead_destroy(struct image_readahead *ra);
+
+/*!
+ * \brief Copy an extent of the image into a file.
+ *
+ * Extents which can be spliced from (see \c image_splice_fd()) are
+ * copied by the kernel with \c copy_file_range() where it is
+ * available; filesystems supporting reflinks may then share the data
+ * instead of copying them. Otherwise the extent is read with
+ * \c image_read().
+ *
+ * \param image image to copy from.
+ * \param offset absolute offset of the extent.
+ * \param size size of the extent.
+ * \param fd file descriptor to write to.
+ * \param pos offset in \c fd to write to.
+ * \param buf buffer of \c IMAGE_COPY_SIZE bytes, allocated on first
+ * use if it is NULL; it has to be freed by the caller.
+ * \return 0 on success, -errno otherwise.
+ */
+int image_copy(struct image *image, off_t offset, off_t size, int fd,
+	       off_t pos, char **buf);
+
+/*!
+ * \brief Close the image and its file descriptor.
+ *
+ * \param image image to be closed.
+ */
+void image_close(struct image *image);
+
+#endif				// _IMAGE_H_
@@ -0,0 +1,535 @@
+/*
+ *  Copyright (C) 2006 Mike Melanson (mike at multimedia.cx)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*!
+ * \file lowlevel.c
+ * \author Mike Melanson
+ * \brief Low-level (inode based) FUSE frontend.
+ *
+ * Inode numbers handed to the kernel are the addresses of the \c tree
+ * nodes themselves (except for the root, which has to be
+ * \c FUSE_ROOT_ID), so no path strings are ever built or resolved.
+ * Directories are loaded with \c tree_load() before their contents are
+ * used.
+ *
+ * In a multi-image mount the root is the top directory listing the
+ * images, which is represented by a NULL node. Image subdirectories
+ * are numbered by the address of their \c xbfsfile with the lowest bit
+ * set, so their numbers don't change when the image is evicted and
+ * loaded again. The image any other node belongs to is found through
+ * the root of its tree; the lookups of such nodes are counted until
+ * the kernel forgets them, and the image is not evicted before.
+ */
+
+#include "tree.h"
+#include "xdvdfs.h"
+
+#include <fuse_lowlevel.h>
+
+//! Bit marking inode numbers of image subdirectories.
+#define XBFS_LL_IMAGE 1
+
+//! Extract \c xbfs_mount structure from FUSE request.
+static inline struct xbfs_mount *get_mount_from_req(fuse_req_t req)
+{
+	return (struct xbfs_mount *)fuse_req_userdata(req);
+}
+
+//! Check if given inode number is the top directory of a multi-image mount.
+static inline int xbfs_ll_top(fuse_req_t req, fuse_ino_t ino)
+{
+	return ino == FUSE_ROOT_ID && get_mount_from_req(req)->multi;
+}
+
+/*!
+ * \brief Get image of an image subdirectory.
+ *
+ * \return the image, or NULL if \c ino is not an image subdirectory.
+ */
+static inline struct xbfsfile *xbfs_ll_image(fuse_ino_t ino)
+{
+	// FUSE_ROOT_ID has the bit set as well
+	if (ino == FUSE_ROOT_ID || !(ino & XBFS_LL_IMAGE))
+		return NULL;
+
+	return (struct xbfsfile *)(uintptr_t)(ino & ~(fuse_ino_t)XBFS_LL_IMAGE);
+}
+
+//! Get image given \c tree node belongs to.
+static inline struct xbfsfile *xbfs_ll_xbfs(struct tree *node)
+{
+	return (struct xbfsfile *)tree_loader_data(tree_root_of(node));
+}
+
+//! Get inode number corresponding to given \c tree node.
+static inline fuse_ino_t xbfs_ll_ino(fuse_req_t req, struct tree *node)
+{
+	// only roots have no parent
+	if (!node->parent)
+		return get_mount_from_req(req)->multi ?
+			(fuse_ino_t)(uintptr_t)xbfs_ll_xbfs(node) |
+			XBFS_LL_IMAGE : FUSE_ROOT_ID;
+
+	return (fuse_ino_t)(uintptr_t)node;
+}
+
+/*!
+ * \brief Start using the \c tree node of given inode.
+ *
+ * The image of the node is loaded if needed, and kept until
+ * \c xbfs_ll_put().
+ *
+ * \param node the node is stored here, NULL for the top directory of a
+ * multi-image mount.
+ * \param xbfs image of the node is stored here, NULL for the top
+ * directory.
+ * \return 0 on success or -errno.
+ */
+static int xbfs_ll_get(fuse_req_t req, fuse_ino_t ino, struct tree **node,
+		       struct xbfsfile **xbfs)
+{
+	struct xbfs_mount *mount = get_mount_from_req(req);
+	struct xbfsfile *image = xbfs_ll_image(ino);
+	int ret;
+
+	*node = NULL;
+	*xbfs = NULL;
+	if (xbfs_ll_top(req, ino))
+		return 0;
+
+	if (ino == FUSE_ROOT_ID)
+		image = mount->images[0];
+	else if (!image)
+		// remembered nodes keep their image loaded
+		image = xbfs_ll_xbfs((struct tree *)(uintptr_t)ino);
+
+	ret = xbfs_mount_use(mount, image);
+	if (ret)
+		return ret;
+
+	*xbfs = image;
+	*node = (ino == FUSE_ROOT_ID || xbfs_ll_image(ino)) ? image->tree :
+		(struct tree *)(uintptr_t)ino;
+
+	return 0;
+}
+
+//! Stop using an image taken by \c xbfs_ll_get().
+static inline void xbfs_ll_put(fuse_req_t req, struct xbfsfile *xbfs)
+{
+	if (xbfs)
+		xbfs_mount_unuse(get_mount_from_req(req), xbfs);
+}
+
+/*!
+ * \brief Fill stat structure of an inode.
+ *
+ * Image subdirectories are described by the catalog, so this never
+ * loads an image.
+ */
+static void xbfs_ll_stat(fuse_req_t req, fuse_ino_t ino, struct stat *stbuf)
+{
+	struct xbfs_mount *mount = get_mount_from_req(req);
+
+	if (xbfs_ll_top(req, ino))
+		xbfs_mount_stat(mount, NULL, stbuf);
+	else if (ino == FUSE_ROOT_ID)
+		tree_stat(mount->images[0]->tree, stbuf);
+	else if (xbfs_ll_image(ino))
+		xbfs_mount_stat(mount, xbfs_ll_image(ino), stbuf);
+	else
+		tree_stat((struct tree *)(uintptr_t)ino, stbuf);
+	// many files share the same offset (e.g. empty ones), but inode
+	// numbers have to be unique here
+	stbuf->st_ino = ino;
+}
+
+// **********************************************************************
+// FUSE low-level operations
+// Please consult fuse_lowlevel.h for description of each operation.
+// **********************************************************************
+
+/*!
+ * \brief Look up a directory entry by name.
+ */
+static void xbfs_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+			   const char *name)
+{
+	struct xbfs_mount *mount = get_mount_from_req(req);
+	struct fuse_entry_param e;
+	struct xbfsfile *xbfs, *image;
+	struct tree *dir, *node;
+	int ret;
+
+	ret = xbfs_ll_get(req, parent, &dir, &xbfs);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	memset(&e, 0, sizeof(e));
+	if (dir) {
+		ret = tree_load(tree_root_of(dir), dir);
+		if (ret) {
+			fuse_reply_err(req, -ret);
+			xbfs_ll_put(req, xbfs);
+			return;
+		}
+		node = tree_find_child(dir, name);
+		if (node)
+			e.ino = xbfs_ll_ino(req, node);
+	} else {
+		// images are the subdirectories of the top directory
+		image = xbfs_mount_find(mount, name, strlen(name));
+		if (image)
+			e.ino = (fuse_ino_t)(uintptr_t)image | XBFS_LL_IMAGE;
+	}
+
+	if (!e.ino) {
+		// a zero inode number makes the kernel cache the failure
+		if (xbfs_options.negative_timeout > 0) {
+			e.entry_timeout = xbfs_options.negative_timeout;
+			fuse_reply_entry(req, &e);
+		} else
+			fuse_reply_err(req, ENOENT);
+		xbfs_ll_put(req, xbfs);
+		return;
+	}
+
+	e.attr_timeout = xbfs_options.attr_timeout;
+	e.entry_timeout = xbfs_options.entry_timeout;
+	xbfs_ll_stat(req, e.ino, &e.attr);
+
+	// counted before the reply, as the forget may come at once
+	if (xbfs)
+		xbfs_mount_lookup(mount, xbfs, 1);
+	if (fuse_reply_entry(req, &e) == -ENOENT && xbfs)
+		// the lookup was interrupted, there will be no forget
+		xbfs_mount_lookup(mount, xbfs, -1);
+	xbfs_ll_put(req, xbfs);
+}
+
+/*!
+ * \brief Forget looked up inodes.
+ */
+static void xbfs_ll_forget(fuse_req_t req, fuse_ino_t ino,
+			   unsigned long nlookup)
+{
+	// only lookups of tree nodes are counted
+	if (ino != FUSE_ROOT_ID && !xbfs_ll_image(ino))
+		xbfs_mount_lookup(get_mount_from_req(req),
+				  xbfs_ll_xbfs((struct tree *)(uintptr_t)ino),
+				  -(long long)nlookup);
+	fuse_reply_none(req);
+}
+
+/*!
+ * \brief Get file attributes.
+ */
+static void xbfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+			    struct fuse_file_info *fi)
+{
+	struct stat stbuf;
+
+	xbfs_ll_stat(req, ino, &stbuf);
+	fuse_reply_attr(req, &stbuf, xbfs_options.attr_timeout);
+}
+
+/*!
+ * \brief File open operation.
+ *
+ * The image stays in use until the file is released.
+ */
+static void xbfs_ll_open(fuse_req_t req, fuse_ino_t ino,
+			 struct fuse_file_info *fi)
+{
+	struct tree_file *file;
+	struct xbfsfile *xbfs;
+	struct tree *node;
+	int ret;
+
+	ret = xbfs_ll_get(req, ino, &node, &xbfs);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	if (!node || node->is_dir)
+		fuse_reply_err(req, EISDIR);
+	else if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		fuse_reply_err(req, EROFS);
+	else {
+		file = tree_file_open(node, xbfs->image);
+		if (!file) {
+			fuse_reply_err(req, ENOMEM);
+			xbfs_ll_put(req, xbfs);
+			return;
+		}
+		fi->fh = (uintptr_t)file;
+		fi->keep_cache = xbfs_options.keep_cache;
+		if (fuse_reply_open(req, fi) != -ENOENT)
+			return;
+		// the open was interrupted, there will be no release
+		tree_file_close(file);
+	}
+	xbfs_ll_put(req, xbfs);
+}
+
+/*!
+ * \brief Release an open file.
+ */
+static void xbfs_ll_release(fuse_req_t req, fuse_ino_t ino,
+			    struct fuse_file_info *fi)
+{
+	struct tree_file *file = (struct tree_file *)(uintptr_t)fi->fh;
+	struct xbfsfile *xbfs = xbfs_ll_xbfs(file->node);
+
+	tree_file_close(file);
+	xbfs_ll_put(req, xbfs);
+	fuse_reply_err(req, 0);
+}
+
+/*!
+ * \brief Read data from an open file.
+ */
+static void xbfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			 off_t offset, struct fuse_file_info *fi)
+{
+#ifdef HAVE_FUSE_READ_BUF
+	struct tree_file *file = (struct tree_file *)(uintptr_t)fi->fh;
+	struct fuse_bufvec bufv;
+	int ret;
+
+	// the reply either splices from the image file or copies from
+	// memory read by tree_file_read_buf()
+	ret = tree_file_read_buf(file, &bufv, size, offset,
+				 xbfs_ll_xbfs(file->node)->image);
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+
+	free(bufv.buf[0].mem);
+#else
+	struct tree_file *file = (struct tree_file *)(uintptr_t)fi->fh;
+	char *buf;
+	int ret;
+
+	buf = (char *)malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	ret = tree_file_read(file, buf, size, offset,
+			     xbfs_ll_xbfs(file->node)->image);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+
+	free(buf);
+#endif
+}
+
+/*!
+ * \brief Open directory.
+ */
+static void xbfs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+			    struct fuse_file_info *fi)
+{
+	struct tree *node = (struct tree *)(uintptr_t)ino;
+
+	// remembered tree nodes stay valid, images are checked by readdir
+	if (ino != FUSE_ROOT_ID && !xbfs_ll_image(ino) && !node->is_dir)
+		fuse_reply_err(req, ENOTDIR);
+	else
+		fuse_reply_open(req, fi);
+}
+
+/*!
+ * \brief Read directory.
+ *
+ * Offset of an entry is its position in the directory, counting "."
+ * and "..", plus one, so continuing a listing is just indexing into
+ * the array of directory contents.
+ */
+static void xbfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			    off_t offset, struct fuse_file_info *fi)
+{
+	struct xbfs_mount *mount = get_mount_from_req(req);
+	struct xbfsfile *xbfs;
+	struct tree *dir, *node;
+	struct stat stbuf;
+	size_t used = 0, len;
+	off_t pos, count;
+	char *buf;
+	int ret;
+
+	ret = xbfs_ll_get(req, ino, &dir, &xbfs);
+	if (!ret && dir)
+		ret = tree_load(tree_root_of(dir), dir);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		xbfs_ll_put(req, xbfs);
+		return;
+	}
+	count = dir ? dir->nsub : mount->nimages;
+
+	buf = (char *)malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		xbfs_ll_put(req, xbfs);
+		return;
+	}
+
+	memset(&stbuf, 0, sizeof(stbuf));
+	for (pos = offset; pos < count + 2; pos++) {
+		const char *name;
+
+		if (pos == 0) {
+			name = ".";
+			stbuf.st_ino = ino;
+			stbuf.st_mode = S_IFDIR;
+		} else if (pos == 1) {
+			// the kernel resolves ".." by itself
+			name = "..";
+			stbuf.st_ino = ino;
+			stbuf.st_mode = S_IFDIR;
+		} else if (dir) {
+			node = &dir->sub[pos - 2];
+			name = node->name;
+			stbuf.st_ino = xbfs_ll_ino(req, node);
+			stbuf.st_mode = node->is_dir ? S_IFDIR : S_IFREG;
+		} else if (!xbfs_mount_listed(mount->images[pos - 2])) {
+			// images found not to be readable are left out
+			continue;
+		} else {
+			// the top directory lists the catalog
+			name = mount->images[pos - 2]->name;
+			stbuf.st_ino = (fuse_ino_t)(uintptr_t)
+				mount->images[pos - 2] | XBFS_LL_IMAGE;
+			stbuf.st_mode = S_IFDIR;
+		}
+
+		len = fuse_add_direntry(req, buf + used, size - used, name,
+					&stbuf, pos + 1);
+		if (len > size - used)
+			break;
+		used += len;
+	}
+
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+	xbfs_ll_put(req, xbfs);
+}
+
+/*!
+ * \brief Initialize filesystem.
+ */
+static void xbfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+#ifdef HAVE_FUSE_READ_BUF
+	// let the kernel take data from the image file through a pipe
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE |
+				       FUSE_CAP_SPLICE_MOVE);
+#endif
+}
+
+#if FUSE_VERSION >= 28
+/*!
+ * \brief Ask the kernel to forget the nodes of an idle image.
+ *
+ * Dropping the image subdirectory from the directory cache drops the
+ * entries below it too, unless they are in use, and the kernel then
+ * forgets their inodes. The image is evicted on a later pass of the
+ * reaper.
+ */
+static void xbfs_ll_idle(struct xbfs_mount *mount, struct xbfsfile *xbfs)
+{
+	fuse_lowlevel_notify_inval_entry((struct fuse_chan *)mount->idle_data,
+					 FUSE_ROOT_ID, xbfs->name,
+					 strlen(xbfs->name));
+}
+#endif
+
+/*!
+ * \brief The FUSE low-level file system operations.
+ */
+static const struct fuse_lowlevel_ops xbfs_ll_operations = {
+	.init = xbfs_ll_init,
+	.lookup = xbfs_ll_lookup,
+	.forget = xbfs_ll_forget,
+	.getattr = xbfs_ll_getattr,
+	.open = xbfs_ll_open,
+	.read = xbfs_ll_read,
+	.release = xbfs_ll_release,
+	.opendir = xbfs_ll_opendir,
+	.readdir = xbfs_ll_readdir,
+};
+
+int xbfs_lowlevel_main(struct fuse_args *args)
+{
+	struct xbfs_mount *mount;
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	char *mountpoint;
+	int multithreaded, foreground;
+	int err = -1;
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+			       &foreground) == -1)
+		return EXIT_FAILURE;
+
+	// the whole tree (or the catalog of images) is built before
+	// mounting, so errors are reported before going to background
+	mount = xbfs_mount_load(xbfs_fd, xbfs_path);
+	if (!mount)
+		return EXIT_FAILURE;
+
+	ch = fuse_mount(mountpoint, args);
+	if (ch) {
+		se = fuse_lowlevel_new(args, &xbfs_ll_operations,
+				       sizeof(xbfs_ll_operations), mount);
+		if (se) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+#if FUSE_VERSION >= 28
+				mount->idle = xbfs_ll_idle;
+				mount->idle_data = ch;
+#endif
+				// the reaper thread wouldn't survive the fork
+				if (fuse_daemonize(foreground) != -1 &&
+				    !xbfs_mount_start(mount))
+					err = multithreaded ?
+					    fuse_session_loop_mt(se) :
+					    fuse_session_loop(se);
+				xbfs_mount_stop(mount);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+
+	xbfs_mount_unload(mount);
+	free(mountpoint);
+
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -27,10 +27,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 
 //! FUSE library compliance level.
-#define FUSE_USE_VERSION 25
+#define FUSE_USE_VERSION 26
 #include <fuse.h>
+#include <fuse_opt.h>
 
 #include "xdvdfs.h"
 
@@ -40,22 +42,106 @@
  */
 int quiet;
 
+//! Define an "-o" option stored in \c xbfs_options.
+#define XBFS_OPT(t, p, v) { t, offsetof(struct xbfs_options, p), v }
+
+/*!
+ * \brief Options handled by xbfuse itself, all other options are
+ * passed to FUSE.
+ */
+static const struct fuse_opt xbfs_opts[] = {
+	XBFS_OPT("backend=%s", backend, 0),
+	XBFS_OPT("lowlevel", lowlevel, 1),
+	XBFS_OPT("lazy", lazy, 1),
+	XBFS_OPT("index_cache=%s", index_cache, 0),
+	XBFS_OPT("load_threads=%d", load_threads, 0),
+	XBFS_OPT("cache_size=%s", cache_size, 0),
+	XBFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+	XBFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+	XBFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+	XBFS_OPT("keep_cache", keep_cache, 1),
+	XBFS_OPT("no_keep_cache", keep_cache, 0),
+	XBFS_OPT("idle_timeout=%d", idle_timeout, 0),
+	XBFS_OPT("memory_limit=%s", memory_limit, 0),
+	FUSE_OPT_END
+};
+
+/*!
+ * \brief Parse size with an optional k, m or g suffix.
+ *
+ * \return 0 on success, -1 if \c str is not a valid size.
+ */
+static int xbfs_parse_size(const char *str, unsigned long long *size)
+{
+	char *end;
+
+	errno = 0;
+	*size = strtoull(str, &end, 10);
+	if (errno || end == str)
+		return -1;
+
+	switch (*end) {
+	case 'g':
+	case 'G':
+		*size <<= 10;
+		// fall through
+	case 'm':
+	case 'M':
+		*size <<= 10;
+		// fall through
+	case 'k':
+	case 'K':
+		*size <<= 10;
+		end++;
+		break;
+	}
+
+	return *end ? -1 : 0;
+}
+
 /*!
  * \brief Main function.
  */
 int main(int argc, char *argv[])
 {
 	char **nargv;
+	char timeouts[256];
+	struct stat st;
 	int nargc, i, j;
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
 
 	if (argc < 3) {
 		fprintf
 		    (stderr,
-		     "Usage: %s <archive_file> <mount_point> [<options>] [<FUSE library options>]\n\n",
+		     "Usage: %s <archive_file>|<directory> <mount_point> [<options>] [<FUSE library options>]\n\n",
 		     argv[0]);
 		fprintf(stderr, "Available options:\n");
 		fprintf(stderr,
 			"\t-q - quiet mode (print only error messages)\n");
+		fprintf(stderr,
+			"\t-o backend=fd|mmap|uring - image access method (default: fd)\n");
+		fprintf(stderr,
+			"\t-o lowlevel - use the inode based FUSE frontend\n");
+		fprintf(stderr,
+			"\t-o lazy - load directories on first use\n");
+		fprintf(stderr,
+			"\t-o index_cache=DIR - keep parsed directory trees in DIR\n");
+		fprintf(stderr,
+			"\t-o load_threads=N - read N directory tables at once\n");
+		fprintf(stderr,
+			"\t-o cache_size=SIZE[k|m|g] - cache image blocks in memory\n");
+		fprintf(stderr,
+			"\t-o entry_timeout=T, -o attr_timeout=T, -o negative_timeout=T -\n"
+			"\t   seconds the kernel caches names, attributes and failed\n"
+			"\t   lookups (default: forever)\n");
+		fprintf(stderr,
+			"\t-o no_keep_cache - drop cached file data on every open\n");
+		fprintf(stderr,
+			"\t-o idle_timeout=T - close images of a directory unused for T\n"
+			"\t   seconds, 0 to keep them (default: 300)\n");
+		fprintf(stderr,
+			"\t-o memory_limit=SIZE[k|m|g] - close least recently used images\n"
+			"\t   of a directory when their trees need more memory\n");
 		exit(EXIT_FAILURE);
 	}
 
@@ -77,12 +163,72 @@ int main(int argc, char *argv[])
 	for (i = 1; i < nargc; i++)
 		nargv[i] = argv[i + 1];
 
-	// try to open the file
-	xbfs_fd = open(argv[1], O_RDONLY);
-	if (xbfs_fd < 0) {
+	// the image never changes, so everything may be cached forever
+	xbfs_options.entry_timeout = XBFS_TIMEOUT_FOREVER;
+	xbfs_options.attr_timeout = XBFS_TIMEOUT_FOREVER;
+	xbfs_options.negative_timeout = XBFS_TIMEOUT_FOREVER;
+	xbfs_options.keep_cache = 1;
+	xbfs_options.idle_timeout = XBFS_IDLE_TIMEOUT;
+
+	args.argc = nargc;
+	args.argv = nargv;
+	if (fuse_opt_parse(&args, &xbfs_options, xbfs_opts, NULL) == -1)
+		exit(EXIT_FAILURE);
+
+	// the path based API applies the timeouts by itself, the
+	// low-level frontend uses xbfs_options directly
+	if (!xbfs_options.lowlevel) {
+		snprintf(timeouts, sizeof(timeouts),
+			 "-oentry_timeout=%f,attr_timeout=%f,negative_timeout=%f",
+			 xbfs_options.entry_timeout, xbfs_options.attr_timeout,
+			 xbfs_options.negative_timeout);
+		if (fuse_opt_add_arg(&args, timeouts) == -1)
+			exit(EXIT_FAILURE);
+	}
+
+	if (xbfs_options.cache_size &&
+	    xbfs_parse_size(xbfs_options.cache_size,
+			    &xbfs_options.cache_bytes)) {
+		fprintf(stderr, "invalid cache size: %s\n",
+			xbfs_options.cache_size);
+		exit(EXIT_FAILURE);
+	}
+
+	if (xbfs_options.memory_limit &&
+	    xbfs_parse_size(xbfs_options.memory_limit,
+			    &xbfs_options.memory_bytes)) {
+		fprintf(stderr, "invalid memory limit: %s\n",
+			xbfs_options.memory_limit);
+		exit(EXIT_FAILURE);
+	}
+
+	if (xbfs_options.idle_timeout < 0) {
+		fprintf(stderr, "invalid idle timeout: %d\n",
+			xbfs_options.idle_timeout);
+		exit(EXIT_FAILURE);
+	}
+
+	// FUSE changes the working directory when it goes to background
+	xbfs_path = realpath(argv[1], NULL);
+	if (!xbfs_path || stat(xbfs_path, &st) < 0) {
 		perror(argv[1]);
 		exit(EXIT_FAILURE);
 	}
 
-	return fuse_main(nargc, nargv, &xbfs_operations);
+	// a directory is scanned for images later, a file is opened now
+	// to report errors before mounting
+	if (S_ISDIR(st.st_mode))
+		xbfs_fd = -1;
+	else {
+		xbfs_fd = open(xbfs_path, O_RDONLY);
+		if (xbfs_fd < 0) {
+			perror(argv[1]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (xbfs_options.lowlevel)
+		return xbfs_lowlevel_main(&args);
+
+	return fuse_main(args.argc, args.argv, &xbfs_operations, NULL);
 }
@@ -22,216 +22,1265 @@
  * \brief Directory hierarchy abstraction file.
  */
 
+#include <stddef.h>
+#include <sys/mman.h>
+
 #include "tree.h"
 
-void tree_insert(struct tree *root, const char *path, int length,
-		 off_t offset, long size, time_t timestamp)
+//! Number of nodes allocated at once.
+#define TREE_ARENA_NODES 4096
+
+//! Size of name pool blocks allocated at once.
+#define TREE_ARENA_NAMES (64 * 1024)
+
+//! Magic of tree cache files.
+#define TREE_CACHE_MAGIC "XBFSTREE"
+
+//! Version of tree cache file layout.
+#define TREE_CACHE_VERSION 1
+
+/*!
+ * \brief Header of a tree cache file.
+ *
+ * It is followed by the key (padded to 8 bytes), all nodes in
+ * breadth-first order (so contents of every directory are contiguous)
+ * and the name pool. Everything is in host byte order, the file is
+ * meant to be used only on the machine which created it.
+ */
+struct tree_cache_header {
+	//! \c TREE_CACHE_MAGIC, not zero terminated.
+	char magic[8];
+
+	//! \c TREE_CACHE_VERSION.
+	uint32_t version;
+
+	//! Size of \c tree_cache_node, to catch different layouts.
+	uint32_t node_size;
+
+	//! Size of the key.
+	uint32_t key_size;
+
+	//! Number of nodes, including the root.
+	uint32_t nnodes;
+
+	//! Size of the name pool.
+	uint64_t names_size;
+};
+
+/*!
+ * \brief One node in a tree cache file.
+ */
+struct tree_cache_node {
+	//! Offset of the file (or directory table).
+	int64_t offset;
+
+	//! Size of the file (or directory table).
+	int64_t size;
+
+	//! Timestamp.
+	int64_t timestamp;
+
+	//! Offset of the name in the name pool.
+	uint32_t name;
+
+	//! Index of the first node of directory contents.
+	uint32_t sub;
+
+	//! Number of files in the directory.
+	uint32_t nsub;
+
+	//! Flag indicating that this a directory.
+	uint8_t is_dir;
+
+	//! Unused, zero.
+	uint8_t pad[3];
+};
+
+//! Round up to a multiple of 8.
+#define TREE_CACHE_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+/*!
+ * \brief One block of memory of \c tree_arena.
+ */
+struct tree_arena_block {
+	//! Previously allocated block.
+	struct tree_arena_block *next;
+
+	//! Used bytes of \c data.
+	size_t used;
+
+	//! Size of \c data.
+	size_t size;
+
+	//! Block memory, aligned for \c struct tree.
+	union {
+		struct tree node[1];
+		char name[1];
+	} data;
+};
+
+/*!
+ * \brief Memory of the whole directory tree.
+ *
+ * All nodes are allocated from large node blocks and all names are
+ * interned into a packed name pool, so building the tree takes only
+ * a few allocations and freeing it doesn't need to visit the nodes.
+ * The root node is embedded as the first member, so the arena can be
+ * found from the root.
+ */
+struct tree_arena {
+	//! Root node of the tree, must be the first member.
+	struct tree root;
+
+	//! Node blocks, the current one first.
+	struct tree_arena_block *nodes;
+
+	//! Name pool blocks, the current one first.
+	struct tree_arena_block *names;
+
+	//! Interned names (open addressing), NULL marks an empty slot.
+	char **strings;
+
+	//! Number of interned names.
+	size_t nstrings;
+
+	//! Number of slots in \c strings, always a power of two.
+	size_t nslots;
+
+	//! Function loading directories on demand.
+	tree_loader_t loader;
+
+	//! Data for \c loader.
+	void *loader_data;
+
+	//! Mutex serializing calls to \c loader.
+	pthread_mutex_t load_lock;
+
+	//! Mutex protecting node blocks and the name pool.
+	pthread_mutex_t alloc_lock;
+};
+
+//! Get arena of the tree given its root.
+static inline struct tree_arena *tree_arena_of(struct tree *root)
 {
-	char *pos;
-	struct tree *node;
+	return (struct tree_arena *)root;
+}
 
-	if (!path || !*path)
-		return;
+//! Allocate new block with \c size bytes of data and push it on \c list.
+static struct tree_arena_block *tree_arena_block_new(
+	struct tree_arena_block **list, size_t size)
+{
+	struct tree_arena_block *block;
 
-	if ((pos = memchr(path, '/', length))) {
-		// Path contains directory.
-		*pos = '\0';
-		node = root->sub;
-
-		// Check if this directory was already inserted by earlier calls.
-		while (node) {
-			if (!strcmp(node->name, path)) {
-				tree_insert(node, pos + 1,
-					    length - (pos + 1 - path),
-					    offset, size, timestamp);
-				return;
-			}
-			node = node->next;
+	block = (struct tree_arena_block *)malloc(
+		offsetof(struct tree_arena_block, data) + size);
+	if (!block)
+		return NULL;
+
+	block->next = *list;
+	block->used = 0;
+	block->size = size;
+	*list = block;
+
+	return block;
+}
+
+//! Free all blocks of \c list.
+static void tree_arena_block_free(struct tree_arena_block *list)
+{
+	struct tree_arena_block *next;
+
+	while (list) {
+		next = list->next;
+		free(list);
+		list = next;
+	}
+}
+
+//! Allocate \c count contiguous nodes from the arena, all zeroed.
+static struct tree *tree_arena_nodes(struct tree_arena *arena, int count)
+{
+	struct tree_arena_block *block = arena->nodes;
+	struct tree *nodes;
+
+	if (!block || block->size - block->used < count) {
+		size_t size = (count > TREE_ARENA_NODES) ? count
+							 : TREE_ARENA_NODES;
+
+		block = tree_arena_block_new(&arena->nodes,
+			size * sizeof(struct tree));
+		if (!block)
+			return NULL;
+		// count nodes rather than bytes in node blocks
+		block->size = size;
+	}
+
+	nodes = &block->data.node[block->used];
+	block->used += count;
+	memset(nodes, 0, count * sizeof(struct tree));
+
+	return nodes;
+}
+
+//! Hash a name of given length (FNV-1a).
+static unsigned int tree_name_hash(const char *name, size_t length)
+{
+	unsigned int hash = 2166136261U;
+
+	while (length--) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/*!
+ * \brief Intern a name into the name pool of the arena.
+ *
+ * Equal names are stored only once (directory names like "media"
+ * repeat a lot), so the returned string must never be modified.
+ *
+ * \return zero terminated copy of \c name or NULL if there is not
+ * enough memory.
+ */
+static char *tree_arena_intern(struct tree_arena *arena, const char *name,
+			       size_t length)
+{
+	struct tree_arena_block *block;
+	size_t slot, i;
+	char *str;
+
+	// grow the table to keep load factor at or below 1/2
+	if ((arena->nstrings + 1) * 2 > arena->nslots) {
+		size_t nslots = arena->nslots ? arena->nslots * 2 : 1024;
+		char **strings = (char **)calloc(nslots, sizeof(char *));
+
+		if (!strings)
+			return NULL;
+		for (i = 0; i < arena->nslots; i++) {
+			if (!arena->strings[i])
+				continue;
+			slot = tree_name_hash(arena->strings[i],
+				strlen(arena->strings[i])) & (nslots - 1);
+			while (strings[slot])
+				slot = (slot + 1) & (nslots - 1);
+			strings[slot] = arena->strings[i];
 		}
+		free(arena->strings);
+		arena->strings = strings;
+		arena->nslots = nslots;
+	}
 
-		// Create new directory.
-		node = (struct tree *)malloc(sizeof(struct tree));
-		node->name = strdup(path);
-		node->is_dir = 1;
-		node->offset = 0;
-		node->size = 0;
-		node->timestamp = timestamp;
-		node->nsubdirs = 0;
-		node->sub = NULL;
-		node->next = root->sub;
+	slot = tree_name_hash(name, length) & (arena->nslots - 1);
+	while ((str = arena->strings[slot])) {
+		if (!strncmp(str, name, length) && !str[length])
+			return str;
+		slot = (slot + 1) & (arena->nslots - 1);
+	}
 
-		// Connect new directory under current directory.
-		root->sub = node;
-		root->nsubdirs++;
+	block = arena->names;
+	if (!block || block->size - block->used < length + 1) {
+		block = tree_arena_block_new(&arena->names,
+			(length + 1 > TREE_ARENA_NAMES) ? length + 1
+							: TREE_ARENA_NAMES);
+		if (!block)
+			return NULL;
+	}
 
-		// Insert remaining parts of path in new directory.
-		tree_insert(node, pos + 1, length - (pos + 1 - path),
-			    offset, size, timestamp);
-	} else {
-		// No more directories in path. Just create new file
-		// under current directory.
-		node = (struct tree *)malloc(sizeof(struct tree));
-		node->name = strndup(path, length);
-		node->is_dir = 0;
-		node->offset = offset;
-		node->size = size;
+	str = &block->data.name[block->used];
+	memcpy(str, name, length);
+	str[length] = '\0';
+	block->used += length + 1;
+
+	arena->strings[slot] = str;
+	arena->nstrings++;
+
+	return str;
+}
+
+//! Upper case of an ASCII character, independent of locale.
+#define TREE_UPPER(c) (((c) >= 'a' && (c) <= 'z') ? (c) - 'a' + 'A' : (c))
+
+/*!
+ * \brief Compare two filenames of given lengths in directory order.
+ */
+static int tree_name_cmp_len(const char *a, size_t alen,
+			     const char *b, size_t blen)
+{
+	size_t i, len = (alen < blen) ? alen : blen;
+	int ca, cb;
+
+	for (i = 0; i < len; i++) {
+		ca = TREE_UPPER((unsigned char)a[i]);
+		cb = TREE_UPPER((unsigned char)b[i]);
+		if (ca != cb)
+			return ca - cb;
+	}
+
+	if (alen != blen)
+		return (alen < blen) ? -1 : 1;
+
+	return memcmp(a, b, len);
+}
+
+int tree_name_cmp(const char *a, const char *b)
+{
+	return tree_name_cmp_len(a, strlen(a), b, strlen(b));
+}
+
+//! \c qsort() comparison function for nodes.
+static int tree_node_cmp(const void *a, const void *b)
+{
+	return tree_name_cmp(((const struct tree *)a)->name,
+			     ((const struct tree *)b)->name);
+}
+
+void tree_set_loader(struct tree *root, tree_loader_t loader, void *data)
+{
+	struct tree_arena *arena = tree_arena_of(root);
+
+	arena->loader = loader;
+	arena->loader_data = data;
+}
+
+void *tree_loader_data(struct tree *root)
+{
+	return tree_arena_of(root)->loader_data;
+}
+
+struct tree *tree_root_of(struct tree *node)
+{
+	while (node->parent)
+		node = node->parent;
+
+	return node;
+}
+
+int tree_load(struct tree *root, struct tree *dir)
+{
+	struct tree_arena *arena = tree_arena_of(root);
+	int ret = 0;
+
+	if (!dir->is_dir)
+		return -ENOTDIR;
+
+	// pairs with the release store in tree_set_children(), so the
+	// contents are visible once the flag is
+	if (__atomic_load_n(&dir->loaded, __ATOMIC_ACQUIRE))
+		return 0;
+
+	if (!arena->loader)
+		return -EIO;
+
+	pthread_mutex_lock(&arena->load_lock);
+	if (!dir->loaded)
+		ret = arena->loader(arena->loader_data, root, dir);
+	pthread_mutex_unlock(&arena->load_lock);
+
+	return ret;
+}
+
+int tree_set_children(struct tree *root, struct tree *dir,
+		      const struct tree_entry *entries, int count,
+		      time_t timestamp)
+{
+	struct tree_arena *arena = tree_arena_of(root);
+	struct tree *nodes = NULL, *node;
+	int i, sorted = 1, nsubdirs = 0;
+
+	if (count <= 0)
+		count = 0;
+
+	// directories may be loaded in parallel, only the allocations
+	// from the arena have to be serialized
+	pthread_mutex_lock(&arena->alloc_lock);
+	if (count) {
+		nodes = tree_arena_nodes(arena, count);
+		if (!nodes) {
+			pthread_mutex_unlock(&arena->alloc_lock);
+			return -ENOMEM;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		nodes[i].name = tree_arena_intern(arena, entries[i].name,
+						  entries[i].length);
+		if (!nodes[i].name) {
+			pthread_mutex_unlock(&arena->alloc_lock);
+			return -ENOMEM;
+		}
+	}
+	pthread_mutex_unlock(&arena->alloc_lock);
+
+	for (i = 0; i < count; i++) {
+		node = &nodes[i];
+		node->is_dir = entries[i].is_dir;
+		node->offset = entries[i].offset;
+		node->size = entries[i].size;
 		node->timestamp = timestamp;
-		node->nsubdirs = 0;
-		node->sub = NULL;
-		node->next = root->sub;
-		root->sub = node;
+		node->parent = dir;
+		if (node->is_dir)
+			nsubdirs++;
+		if (i && tree_name_cmp(nodes[i - 1].name, node->name) > 0)
+			sorted = 0;
+	}
+
+	// directory tables are binary search trees, so their in-order
+	// traversal is already sorted unless the image is damaged
+	if (!sorted)
+		qsort(nodes, count, sizeof(struct tree), tree_node_cmp);
+
+	dir->sub = nodes;
+	dir->nsub = count;
+	dir->nsubdirs = nsubdirs;
+	__atomic_store_n(&dir->loaded, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*!
+ * \brief Find a file of given name length inside of given directory.
+ */
+static struct tree *tree_find_child_len(struct tree *dir, const char *name,
+					size_t length)
+{
+	int low = 0, high = dir->nsub - 1, mid, cmp;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		cmp = tree_name_cmp_len(dir->sub[mid].name,
+					strlen(dir->sub[mid].name),
+					name, length);
+		if (!cmp)
+			return &dir->sub[mid];
+		if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid - 1;
 	}
+
+	return NULL;
 }
 
 struct tree *tree_find_entry(struct tree *root, const char *path)
 {
-	struct tree *node, *ret;
-	const char *next;
+	struct tree *node = root;
+	const char *end;
 
-	if (!root)
+	if (!root || *path != '/')
 		return NULL;
 
-	if (!strcmp(path, root->name))
-		return root;
+	while (node) {
+		while (*path == '/')
+			path++;
+		if (!*path)
+			return node;
+		if (tree_load(root, node))
+			return NULL;
 
-	if (strncmp(path, root->name, strlen(root->name)))
+		end = strchr(path, '/');
+		if (!end)
+			end = path + strlen(path);
+		node = tree_find_child_len(node, path, end - path);
+		path = end;
+	}
+
+	return NULL;
+}
+
+/*!
+ * \brief Hash a full path (FNV-1a), never returning zero.
+ */
+static unsigned int tree_index_hash(const char *path)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*path) {
+		hash ^= (unsigned char)*path++;
+		hash *= 16777619U;
+	}
+
+	return hash ? hash : 1;
+}
+
+//! Count all nodes in the tree, including \c root.
+static size_t tree_count(struct tree *root)
+{
+	size_t count = 1;
+	int i;
+
+	for (i = 0; i < root->nsub; i++)
+		count += tree_count(&root->sub[i]);
+
+	return count;
+}
+
+/*!
+ * \brief Add \c node and all its children to the index.
+ *
+ * \param index index being built.
+ * \param node node to add.
+ * \param parent offset of the parent path inside of \c index->paths,
+ * or -1 when adding the root.
+ * \return 0 on success, -1 if there is not enough memory.
+ */
+static int tree_index_add(struct tree_index *index, struct tree *node,
+			  ssize_t parent)
+{
+	size_t start, len, parent_len, slot;
+	int i;
+	unsigned int hash;
+	char *paths;
+
+	parent_len = (parent < 0) ? 0 : strlen(index->paths + parent);
+	len = (parent < 0) ? 1 : parent_len + 1 + strlen(node->name);
+	// the root path is "/", don't double the slash below it
+	if (parent_len == 1)
+		len--;
+
+	if (index->paths_size + len + 1 > index->paths_alloc) {
+		size_t alloc = index->paths_alloc * 2;
+
+		while (index->paths_size + len + 1 > alloc)
+			alloc *= 2;
+		paths = (char *)realloc(index->paths, alloc);
+		if (!paths)
+			return -1;
+		index->paths = paths;
+		index->paths_alloc = alloc;
+	}
+
+	start = index->paths_size;
+	if (parent < 0) {
+		strcpy(index->paths + start, "/");
+	} else {
+		memcpy(index->paths + start, index->paths + parent, parent_len);
+		if (parent_len == 1)
+			strcpy(index->paths + start + 1, node->name);
+		else {
+			index->paths[start + parent_len] = '/';
+			strcpy(index->paths + start + parent_len + 1,
+			       node->name);
+		}
+	}
+	index->paths_size += len + 1;
+
+	hash = tree_index_hash(index->paths + start);
+	slot = hash & (index->nslots - 1);
+	while (index->slots[slot].hash)
+		slot = (slot + 1) & (index->nslots - 1);
+	index->slots[slot].hash = hash;
+	index->slots[slot].path = start;
+	index->slots[slot].node = node;
+
+	for (i = 0; i < node->nsub; i++)
+		if (tree_index_add(index, &node->sub[i], start))
+			return -1;
+
+	return 0;
+}
+
+struct tree_index *tree_index_build(struct tree *root)
+{
+	struct tree_index *index;
+	size_t count;
+
+	index = (struct tree_index *)malloc(sizeof(struct tree_index));
+	if (!index)
 		return NULL;
 
-	next = path + strlen(root->name);
-	if (*next != '/')
+	// keep the load factor at or below 1/2
+	count = tree_count(root);
+	index->nslots = 16;
+	while (index->nslots < count * 2)
+		index->nslots *= 2;
+
+	index->slots = (struct tree_index_slot *)calloc(index->nslots,
+		sizeof(struct tree_index_slot));
+	index->paths_alloc = 4096;
+	index->paths_size = 0;
+	index->paths = (char *)malloc(index->paths_alloc);
+
+	if (!index->slots || !index->paths ||
+	    tree_index_add(index, root, -1)) {
+		tree_index_free(index);
 		return NULL;
-	next++;
+	}
 
-	if (!*next)
-		return root;
+	return index;
+}
 
-	node = root->sub;
-	while (node) {
-		ret = tree_find_entry(node, next);
-		if (ret)
-			return ret;
+struct tree *tree_index_find(struct tree_index *index, const char *path)
+{
+	unsigned int hash;
+	size_t slot;
 
-		node = node->next;
+	hash = tree_index_hash(path);
+	slot = hash & (index->nslots - 1);
+	while (index->slots[slot].hash) {
+		if (index->slots[slot].hash == hash &&
+		    !strcmp(index->paths + index->slots[slot].path, path))
+			return index->slots[slot].node;
+		slot = (slot + 1) & (index->nslots - 1);
 	}
 
 	return NULL;
 }
 
+void tree_index_free(struct tree_index *index)
+{
+	if (!index)
+		return;
+
+	free(index->slots);
+	free(index->paths);
+	free(index);
+}
+
 void tree_free(struct tree *root)
 {
-	struct tree *node, *next;
+	struct tree_arena *arena = tree_arena_of(root);
 
-	node = root->sub;
-	while (node) {
-		next = node->next;
-		tree_free(node);
-		node = next;
+	tree_arena_block_free(arena->nodes);
+	tree_arena_block_free(arena->names);
+	free(arena->strings);
+	pthread_mutex_destroy(&arena->load_lock);
+	pthread_mutex_destroy(&arena->alloc_lock);
+	free(arena);
+}
+
+size_t tree_memory(struct tree *root)
+{
+	struct tree_arena *arena = tree_arena_of(root);
+	struct tree_arena_block *block;
+	size_t size;
+
+	pthread_mutex_lock(&arena->alloc_lock);
+	size = sizeof(struct tree_arena) + arena->nslots * sizeof(char *);
+	// node blocks count nodes, name blocks count bytes
+	for (block = arena->nodes; block; block = block->next)
+		size += offsetof(struct tree_arena_block, data) +
+			block->size * sizeof(struct tree);
+	for (block = arena->names; block; block = block->next)
+		size += offsetof(struct tree_arena_block, data) + block->size;
+	pthread_mutex_unlock(&arena->alloc_lock);
+
+	return size;
+}
+
+//! \c qsort() comparison function for extents.
+static int tree_extent_cmp(const void *a, const void *b)
+{
+	const struct tree_extent *x = (const struct tree_extent *)a;
+	const struct tree_extent *y = (const struct tree_extent *)b;
+
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+int tree_extents_merge(struct tree_extent *extents, int count, off_t align)
+{
+	off_t end;
+	int i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		end = (extents[i].offset + extents[i].size + align - 1) &
+			~(align - 1);
+		extents[i].offset &= ~(align - 1);
+		extents[i].size = end - extents[i].offset;
+	}
+
+	qsort(extents, count, sizeof(struct tree_extent), tree_extent_cmp);
+
+	for (i = 0; i < count; i++) {
+		end = extents[i].offset + extents[i].size;
+		if (n && extents[i].offset <=
+		    extents[n - 1].offset + extents[n - 1].size) {
+			if (end > extents[n - 1].offset + extents[n - 1].size)
+				extents[n - 1].size =
+					end - extents[n - 1].offset;
+		} else
+			extents[n++] = extents[i];
+	}
+
+	return n;
+}
+
+/*!
+ * \brief Extents collected by \c tree_extents_add().
+ */
+struct tree_extent_list {
+	//! Collected extents.
+	struct tree_extent *extents;
+	//! Number of \c extents.
+	int count;
+	//! Allocated size of \c extents.
+	int alloc;
+};
+
+//! Add extents of \c node and all its children to \c list.
+static int tree_extents_add(struct tree_extent_list *list, struct tree *node)
+{
+	struct tree_extent *extents;
+	int i;
+
+	if (node->size > 0) {
+		if (list->count == list->alloc) {
+			list->alloc = list->alloc ? list->alloc * 2 : 256;
+			extents = (struct tree_extent *)realloc(list->extents,
+				list->alloc * sizeof(struct tree_extent));
+			if (!extents)
+				return -1;
+			list->extents = extents;
+		}
+		list->extents[list->count].offset = node->offset;
+		list->extents[list->count].size = node->size;
+		list->count++;
+	}
+
+	if (!node->is_dir || !node->loaded)
+		return 0;
+	for (i = 0; i < node->nsub; i++)
+		if (tree_extents_add(list, &node->sub[i]))
+			return -1;
+
+	return 0;
+}
+
+int tree_extents(struct tree *root, off_t align, struct tree_extent **extents)
+{
+	struct tree_extent_list list = { NULL, 0, 0 };
+
+	if (tree_extents_add(&list, root)) {
+		free(list.extents);
+		return -ENOMEM;
 	}
 
-	free(root->name);
-	free(root);
+	*extents = list.extents;
+
+	return tree_extents_merge(list.extents, list.count, align);
 }
 
 struct tree *tree_empty(void)
 {
-	struct tree *ret;
+	struct tree_arena *arena;
 
-	ret = (struct tree *)malloc(sizeof(struct tree));
-	ret->name = strdup("");
-	ret->is_dir = 1;
-	ret->offset = 0;
-	ret->size = 0;
-	ret->nsubdirs = 0;
-	ret->sub = NULL;
-	ret->next = NULL;
+	arena = (struct tree_arena *)calloc(1, sizeof(struct tree_arena));
+	if (!arena)
+		return NULL;
 
-	return ret;
+	arena->root.name = "";
+	arena->root.is_dir = 1;
+	pthread_mutex_init(&arena->load_lock, NULL);
+	pthread_mutex_init(&arena->alloc_lock, NULL);
+
+	return &arena->root;
 }
 
-int tree_getattr(const char *path, struct stat *stbuf, struct tree *root,
-		 int fd)
+//! Write whole buffer to \c fd.
+static int tree_write_all(int fd, const void *buf, size_t size)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = write(fd, buf, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf = (const char *)buf + ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+int tree_save(struct tree *root, int fd, const void *key, size_t key_size)
 {
+	struct tree_arena *arena = tree_arena_of(root);
+	struct tree_arena_block *block, **blocks;
+	struct tree_cache_header header;
+	struct tree_cache_node *records;
+	struct tree **queue;
 	struct tree *node;
+	size_t count, head, tail, names_size, base, i;
+	int nblocks, b, ret = 0;
+	char *pool;
 
-	node = tree_find_entry(root, path);
-	if (node) {
-		memset(stbuf, 0, sizeof(struct stat));
-		// Set UID and GID to current user
-		stbuf->st_uid = getuid();
-		stbuf->st_gid = getgid();
-		if (node->is_dir) {
-			stbuf->st_mode =
-			    S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR
-			    | S_IXGRP | S_IXOTH;
-			// Directory should have number of links set
-			// to 2 + number of subdirectories (not
-			// files), this makes find work.
+	// the name pool is the empty name of the root followed by the
+	// arena name blocks, oldest first
+	nblocks = 0;
+	for (block = arena->names; block; block = block->next)
+		nblocks++;
+	blocks = (struct tree_arena_block **)malloc((nblocks + 1)
+		* sizeof(struct tree_arena_block *));
+	if (!blocks)
+		return -ENOMEM;
+	names_size = 1;
+	for (block = arena->names, b = nblocks - 1; block;
+	     block = block->next, b--) {
+		blocks[b] = block;
+		names_size += block->used;
+	}
+
+	count = tree_count(root);
+	queue = (struct tree **)malloc(count * sizeof(struct tree *));
+	records = (struct tree_cache_node *)calloc(count,
+		sizeof(struct tree_cache_node));
+	pool = (char *)calloc(1, TREE_CACHE_ALIGN(key_size) + names_size);
+	if (!queue || !records || !pool) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	// number nodes breadth-first, so that contents of every
+	// directory get consecutive indexes
+	queue[0] = root;
+	for (head = 0, tail = 1; head < tail; head++) {
+		node = queue[head];
+		if (node->is_dir && !node->loaded) {
+			// only complete trees can be cached
+			ret = -EAGAIN;
+			goto out;
+		}
+
+		records[head].offset = node->offset;
+		records[head].size = node->size;
+		records[head].timestamp = node->timestamp;
+		records[head].is_dir = node->is_dir;
+		records[head].sub = tail;
+		records[head].nsub = node->nsub;
+
+		for (b = 0, base = 1; b < nblocks && *node->name; b++) {
+			if (node->name >= blocks[b]->data.name &&
+			    node->name < blocks[b]->data.name + blocks[b]->used) {
+				records[head].name = base
+					+ (node->name - blocks[b]->data.name);
+				break;
+			}
+			base += blocks[b]->used;
+		}
+
+		for (i = 0; i < node->nsub; i++)
+			queue[tail++] = &node->sub[i];
+	}
+
+	memcpy(pool, key, key_size);
+	base = TREE_CACHE_ALIGN(key_size) + 1;
+	for (b = 0; b < nblocks; b++) {
+		memcpy(pool + base, blocks[b]->data.name, blocks[b]->used);
+		base += blocks[b]->used;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TREE_CACHE_MAGIC, sizeof(header.magic));
+	header.version = TREE_CACHE_VERSION;
+	header.node_size = sizeof(struct tree_cache_node);
+	header.key_size = key_size;
+	header.nnodes = count;
+	header.names_size = names_size;
+
+	ret = tree_write_all(fd, &header, sizeof(header));
+	if (!ret)
+		ret = tree_write_all(fd, pool, TREE_CACHE_ALIGN(key_size));
+	if (!ret)
+		ret = tree_write_all(fd, records,
+				     count * sizeof(struct tree_cache_node));
+	if (!ret)
+		ret = tree_write_all(fd, pool + TREE_CACHE_ALIGN(key_size),
+				     names_size);
+
+out:
+	free(blocks);
+	free(queue);
+	free(records);
+	free(pool);
+
+	return ret;
+}
+
+struct tree *tree_restore(int fd, const void *key, size_t key_size)
+{
+	const struct tree_cache_header *header;
+	const struct tree_cache_node *records;
+	struct tree_arena *arena;
+	struct tree_arena_block *names;
+	struct tree *root, *nodes = NULL, *node;
+	const char *map, *pool;
+	size_t map_size, nodes_offset, names_offset;
+	uint32_t i, j;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*header))
+		return NULL;
+	map_size = st.st_size;
+
+	map = (const char *)mmap(NULL, map_size, PROT_READ, MAP_PRIVATE,
+				 fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	header = (const struct tree_cache_header *)map;
+	nodes_offset = sizeof(*header) + TREE_CACHE_ALIGN(key_size);
+	names_offset = nodes_offset + (size_t)header->nnodes
+		* sizeof(struct tree_cache_node);
+	if (memcmp(header->magic, TREE_CACHE_MAGIC, sizeof(header->magic)) ||
+	    header->version != TREE_CACHE_VERSION ||
+	    header->node_size != sizeof(struct tree_cache_node) ||
+	    header->key_size != key_size || !header->nnodes ||
+	    header->names_size < 1 ||
+	    names_offset + header->names_size != map_size ||
+	    memcmp(map + sizeof(*header), key, key_size) ||
+	    map[map_size - 1]) {
+		munmap((void *)map, map_size);
+		return NULL;
+	}
+	records = (const struct tree_cache_node *)(map + nodes_offset);
+	pool = map + names_offset;
+
+	root = tree_empty();
+	if (!root) {
+		munmap((void *)map, map_size);
+		return NULL;
+	}
+	arena = tree_arena_of(root);
+
+	// a couple of large allocations: all nodes and the name pool
+	if (header->nnodes > 1) {
+		nodes = tree_arena_nodes(arena, header->nnodes - 1);
+		if (!nodes)
+			goto fail;
+	}
+	names = tree_arena_block_new(&arena->names, header->names_size);
+	if (!names)
+		goto fail;
+	memcpy(names->data.name, pool, header->names_size);
+	names->used = header->names_size;
+
+	for (i = 0; i < header->nnodes; i++) {
+		node = i ? &nodes[i - 1] : root;
+
+		// children always come after their parent, which also
+		// rules out loops
+		if (records[i].name >= header->names_size ||
+		    (records[i].nsub && (records[i].sub <= i ||
+		     records[i].sub + (uint64_t)records[i].nsub
+		     > header->nnodes)))
+			goto fail;
+
+		node->name = names->data.name + records[i].name;
+		node->is_dir = records[i].is_dir;
+		node->loaded = node->is_dir;
+		node->offset = records[i].offset;
+		node->size = records[i].size;
+		node->timestamp = records[i].timestamp;
+		node->nsub = records[i].nsub;
+		node->sub = node->nsub ? &nodes[records[i].sub - 1] : NULL;
+	}
+	root->name = "";
+
+	for (i = 0; i < header->nnodes; i++) {
+		node = i ? &nodes[i - 1] : root;
+		for (j = 0; j < node->nsub; j++) {
+			node->sub[j].parent = node;
+			if (node->sub[j].is_dir)
+				node->nsubdirs++;
+		}
+	}
+
+	munmap((void *)map, map_size);
+
+	return root;
+
+fail:
+	munmap((void *)map, map_size);
+	tree_free(root);
+
+	return NULL;
+}
+
+/*!
+ * \brief Find given path, using the full path index if available.
+ */
+static inline struct tree *tree_lookup(struct tree *root,
+				       struct tree_index *index,
+				       const char *path)
+{
+	if (index)
+		return tree_index_find(index, path);
+
+	return tree_find_entry(root, path);
+}
+
+/*!
+ * \brief Get node stored in FUSE file information by opendir.
+ *
+ * Falls back to looking up \c path when there is no such node.
+ */
+static inline struct tree *tree_lookup_fi(struct tree *root,
+					  struct tree_index *index,
+					  const char *path,
+					  struct fuse_file_info *fi)
+{
+	if (fi && fi->fh)
+		return (struct tree *)(uintptr_t)fi->fh;
+
+	return tree_lookup(root, index, path);
+}
+
+void tree_stat(struct tree *node, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	// Set UID and GID to current user
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	if (node->is_dir) {
+		stbuf->st_mode =
+		    S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR
+		    | S_IXGRP | S_IXOTH;
+		// Directory should have number of links set
+		// to 2 + number of subdirectories (not
+		// files), this makes find work.
+		if (__atomic_load_n(&node->loaded, __ATOMIC_ACQUIRE))
 			stbuf->st_nlink = 2 + node->nsubdirs;
-		} else {
-			stbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+		else
 			stbuf->st_nlink = 1;
-			stbuf->st_size = node->size;
-			stbuf->st_ino = node->offset;
-		}
+	} else {
+		stbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = node->size;
+		stbuf->st_ino = node->offset;
+	}
+
+	stbuf->st_atime = node->timestamp;
+	stbuf->st_mtime = node->timestamp;
+	stbuf->st_ctime = node->timestamp;
+}
+
+struct tree *tree_find_child(struct tree *dir, const char *name)
+{
+	return tree_find_child_len(dir, name, strlen(name));
+}
+
+int tree_read_node(struct tree *node, char *buf, size_t size,
+		   off_t offset, struct image *image)
+{
+	if (node->is_dir)
+		return -EISDIR;
+
+	if (offset >= node->size)
+		return 0;
+	if (offset + size > node->size)
+		size = node->size - offset;
+
+	return image_read(image, buf, size, node->offset + offset);
+}
+
+struct tree_file *tree_file_open(struct tree *node, struct image *image)
+{
+	struct tree_file *file;
+
+	file = (struct tree_file *)malloc(sizeof(struct tree_file));
+	if (!file)
+		return NULL;
+
+	file->node = node;
+	image_readahead_init(&file->ra, node->offset, node->size);
+	image_advise(image, node->offset, node->size);
+
+	return file;
+}
+
+int tree_file_read(struct tree_file *file, char *buf, size_t size,
+		   off_t offset, struct image *image)
+{
+	struct tree *node = file->node;
+
+	if (offset >= node->size)
+		return 0;
+	if (offset + size > node->size)
+		size = node->size - offset;
+
+	image_readahead(image, &file->ra, node->offset + offset, size);
+
+	return image_read(image, buf, size, node->offset + offset);
+}
+
+#ifdef HAVE_FUSE_READ_BUF
+/*!
+ * \brief Read data of a node into a FUSE buffer.
+ *
+ * \param ra read-ahead state of the node or NULL.
+ */
+static int tree_read_node_buf(struct tree *node, struct image_readahead *ra,
+			      struct fuse_bufvec *bufv, size_t size,
+			      off_t offset, struct image *image)
+{
+	off_t pos;
+	ssize_t ret;
+	int fd;
+
+	*bufv = FUSE_BUFVEC_INIT(0);
+	if (node->is_dir)
+		return -EISDIR;
+
+	if (offset >= node->size)
+		size = 0;
+	else if (offset + size > node->size)
+		size = node->size - offset;
+
+	bufv->buf[0].size = size;
+	if (!size)
+		return 0;
+
+	if (ra)
+		image_readahead(image, ra, node->offset + offset, size);
+
+	// trimmed images keep every file extent in one piece, so they
+	// can be spliced from like plain ones
+	fd = image_splice_fd(image, node->offset + offset, size, &pos);
+	if (fd >= 0) {
+		bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		bufv->buf[0].fd = fd;
+		bufv->buf[0].pos = pos;
+		return 0;
+	}
+
+	bufv->buf[0].mem = malloc(size);
+	if (!bufv->buf[0].mem)
+		return -ENOMEM;
+
+	ret = image_read(image, bufv->buf[0].mem, size, node->offset + offset);
+	if (ret < 0) {
+		free(bufv->buf[0].mem);
+		bufv->buf[0].mem = NULL;
+		return ret;
+	}
+	bufv->buf[0].size = ret;
+
+	return 0;
+}
+
+int tree_file_read_buf(struct tree_file *file, struct fuse_bufvec *bufv,
+		       size_t size, off_t offset, struct image *image)
+{
+	return tree_read_node_buf(file->node, &file->ra, bufv, size, offset,
+				  image);
+}
+#endif
+
+void tree_file_close(struct tree_file *file)
+{
+	if (!file)
+		return;
 
-		stbuf->st_atime = node->timestamp;
-		stbuf->st_mtime = node->timestamp;
-		stbuf->st_ctime = node->timestamp;
+	image_readahead_destroy(&file->ra);
+	free(file);
+}
 
+int tree_getattr(const char *path, struct stat *stbuf, struct tree *root,
+		 struct tree_index *index, int fd)
+{
+	struct tree *node;
+
+	node = tree_lookup(root, index, path);
+	if (node) {
+		tree_stat(node, stbuf);
 		return 0;
 	} else
 		return -ENOENT;
 }
 
-int tree_open(const char *path, struct fuse_file_info *fi, struct tree *root)
+int tree_open(const char *path, struct fuse_file_info *fi, struct tree *root,
+	      struct tree_index *index, struct image *image)
 {
+	struct tree_file *file;
 	struct tree *node;
 
 	if (fi->flags & O_WRONLY)
 		return -EROFS;
 
-	node = tree_find_entry(root, path);
+	node = tree_lookup(root, index, path);
 
 	if (!node)
 		return -ENOENT;
 
+	if (node->is_dir)
+		return -EISDIR;
+
+	// Remember the node, so that reads don't have to resolve the
+	// path again. Nodes live as long as the filesystem is mounted.
+	file = tree_file_open(node, image);
+	if (!file)
+		return -ENOMEM;
+	fi->fh = (uintptr_t)file;
+
+	return 0;
+}
+
+int tree_release(const char *path, struct fuse_file_info *fi)
+{
+	tree_file_close((struct tree_file *)(uintptr_t)fi->fh);
+	fi->fh = 0;
+
 	return 0;
 }
 
 int tree_read(const char *path, char *buf, size_t size,
 	      off_t offset, struct fuse_file_info *fi, struct tree *root,
-	      int fd, pthread_mutex_t * mutex)
+	      struct tree_index *index, struct image *image)
 {
 	struct tree *node;
-	int ret;
 
-	node = tree_find_entry(root, path);
+	if (fi && fi->fh)
+		return tree_file_read((struct tree_file *)(uintptr_t)fi->fh,
+				      buf, size, offset, image);
+
+	node = tree_lookup(root, index, path);
 	if (!node)
 		return -ENOENT;
 
-	if (node->is_dir)
-		return -EISDIR;
+	return tree_read_node(node, buf, size, offset, image);
+}
 
-	if (offset >= node->size)
-		return 0;
-	if (offset + size > node->size)
-		size = node->size - offset;
+#ifdef HAVE_FUSE_READ_BUF
+int tree_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+		  off_t offset, struct fuse_file_info *fi, struct tree *root,
+		  struct tree_index *index, struct image *image)
+{
+	struct tree_file *file = NULL;
+	struct fuse_bufvec *bufv;
+	struct tree *node;
+	int ret;
 
-	// This is needed to ensure, that no other thread will change
-	// seek point before we call read().
-	pthread_mutex_lock(mutex);
+	if (fi && fi->fh) {
+		file = (struct tree_file *)(uintptr_t)fi->fh;
+		node = file->node;
+	} else
+		node = tree_lookup(root, index, path);
+	if (!node)
+		return -ENOENT;
 
-	lseek(fd, node->offset + offset, SEEK_SET);
-	ret = read(fd, buf, size);
+	bufv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+	if (!bufv)
+		return -ENOMEM;
 
-	pthread_mutex_unlock(mutex);
+	ret = tree_read_node_buf(node, file ? &file->ra : NULL, bufv, size,
+				 offset, image);
+	if (ret) {
+		free(bufv);
+		return ret;
+	}
+	*bufp = bufv;
 
-	return ret;
+	return 0;
 }
+#endif
 
-int tree_opendir(const char *path, struct fuse_file_info *fi, struct tree *root)
+int tree_opendir(const char *path, struct fuse_file_info *fi, struct tree *root,
+		 struct tree_index *index)
 {
-	struct tree *node = tree_find_entry(root, path);
+	struct tree *node = tree_lookup(root, index, path);
 
 	if (!node)
 		return -ENOENT;
@@ -239,16 +1288,20 @@ int tree_opendir(const char *path, struct fuse_file_info *fi, struct tree *root)
 	if (!node->is_dir)
 		return -ENOTDIR;
 
+	fi->fh = (uintptr_t)node;
+
 	return 0;
 }
 
 int tree_readdir(const char *path, void *buf,
 		 fuse_fill_dir_t filler, off_t offset,
-		 struct fuse_file_info *fi, struct tree *root)
+		 struct fuse_file_info *fi, struct tree *root,
+		 struct tree_index *index)
 {
 	struct tree *node;
+	int i, ret;
 
-	node = tree_find_entry(root, path);
+	node = tree_lookup_fi(root, index, path, fi);
 
 	if (!node)
 		return -ENOENT;
@@ -256,14 +1309,15 @@ int tree_readdir(const char *path, void *buf,
 	if (!node->is_dir)
 		return -ENOTDIR;
 
+	ret = tree_load(root, node);
+	if (ret)
+		return ret;
+
 	filler(buf, ".", NULL, 0);
 	filler(buf, "..", NULL, 0);
 
-	node = node->sub;
-	while (node) {
-		filler(buf, node->name, NULL, 0);
-		node = node->next;
-	}
+	for (i = 0; i < node->nsub; i++)
+		filler(buf, node->sub[i].name, NULL, 0);
 
 	return 0;
 }
@@ -35,42 +35,65 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdint.h>
 #include <pthread.h>
 
 //! FUSE library compliance level.
-#define FUSE_USE_VERSION 25
+#define FUSE_USE_VERSION 26
 #include <fuse.h>
 
+#if FUSE_VERSION >= 29
+//! libfuse has the read_buf operation and can splice its buffers.
+#define HAVE_FUSE_READ_BUF 1
+#endif
+
+#include "image.h"
+
 /*!
  * \brief GRAF directory hierarchy structure.
  *
- * This structure represents directory structure from GRAF. You should
- * insert files into this structure (filenames can contain '/',
- * corresponding directories will be made automatically). There are
- * also FUSE operations on this structure provided, which can be used
- * to quickly implement FUSE filesystem.
+ * This structure represents directory structure from GRAF. Contents
+ * of a directory are set at once with \c tree_set_children() and are
+ * kept as a contiguous array sorted by name (see \c tree_name_cmp()),
+ * so that looking up a name is a binary search and listing a
+ * directory is a linear walk. There are also FUSE operations on this
+ * structure provided, which can be used to quickly implement FUSE
+ * filesystem.
  */
 struct tree {
 	/*!
 	 * \brief Filename.
 	 *
 	 * Should be empty string in the root of the tree. Otherwise
-	 * searching function won't work.
+	 * searching function won't work. Names are interned in the
+	 * name pool of the tree, so they must never be modified.
 	 */
-	char *name;
+	const char *name;
 
 	/*!
 	 * \brief Flag indicating that this a directory.
 	 */
 	char is_dir;
 
+	/*!
+	 * \brief Flag indicating that contents of this directory are set.
+	 *
+	 * Directories may be loaded lazily (see \c tree_load()); until
+	 * then \c nsub, \c sub and \c nsubdirs are meaningless.
+	 */
+	char loaded;
+
 	/*!
 	 * \brief Offset of the file inside of GRAF.
+	 *
+	 * For directories this is the offset of the directory table.
 	 */
 	off_t offset;
 
 	/*!
 	 * \brief Size of the file inside of GRAF.
+	 *
+	 * For directories this is the size of the directory table.
 	 */
 	off_t size;
 
@@ -85,51 +108,244 @@ struct tree {
 	 * This is used to calculate correct number of hard links,
 	 * which for directories should be 2 + number of
 	 * subdirectories. This is especially needed to make find
-	 * work. It will be incremented when inserting directories.
+	 * work. It is set by \c tree_set_children().
 	 */
 	int nsubdirs;
 
 	/*!
-	 * \brief Subdirectories.
+	 * \brief Number of files in the directory.
+	 */
+	int nsub;
+
+	/*!
+	 * \brief Contents of the directory.
 	 *
-	 * If the current file is a regular file this field is NULL. Otherwise
-	 * it is a pointer to first element of directory.
+	 * If the current file is a regular file (or an empty directory)
+	 * this field is NULL. Otherwise it is a pointer to the first of
+	 * \c nsub nodes, sorted by name.
 	 */
 	struct tree *sub;
 
 	/*!
-	 * \brief Next file.
+	 * \brief Directory containing this file, NULL in the root.
+	 */
+	struct tree *parent;
+};
+
+/*!
+ * \brief Description of one file passed to \c tree_set_children().
+ */
+struct tree_entry {
+	/*!
+	 * \brief Filename, not necessarily zero terminated.
+	 */
+	const char *name;
+
+	/*!
+	 * \brief Length of \c name.
+	 */
+	int length;
+
+	/*!
+	 * \brief Flag indicating that this a directory.
+	 */
+	char is_dir;
+
+	/*!
+	 * \brief Offset of the file (or directory table) inside of GRAF.
+	 */
+	off_t offset;
+
+	/*!
+	 * \brief Size of the file (or directory table) inside of GRAF.
+	 */
+	off_t size;
+};
+
+/*!
+ * \brief One slot of the \c tree_index hash table.
+ */
+struct tree_index_slot {
+	/*!
+	 * \brief Hash of the full path.
 	 *
-	 * This is a pointer to the next file on the same directory
-	 * level.
+	 * Zero marks an empty slot, so hashes are never zero.
+	 */
+	unsigned int hash;
+
+	/*!
+	 * \brief Offset of the full path inside of \c tree_index::paths.
 	 */
-	struct tree *next;
+	size_t path;
+
+	/*!
+	 * \brief Node corresponding to the full path.
+	 */
+	struct tree *node;
 };
 
 /*!
- * \brief Insert path into representation of GRAF firectory tree.
+ * \brief Full path index of GRAF directory hierarchy.
  *
- * This function inserts given pathname into the \c tree structure,
- * which describes directory structure inside of GRAF. Every needed
- * subdirectories will be created by this function.
+ * This structure maps every full path (exactly as provided by FUSE,
+ * so starting with '/') to its \c tree node, so that lookups cost
+ * O(path length) instead of walking the tree. It is an open
+ * addressing hash table with linear probing. It should be built with
+ * \c tree_index_build() after the tree is complete and it is never
+ * modified afterwards, so it can be used by many threads without
+ * locking.
+ */
+struct tree_index {
+	/*!
+	 * \brief Number of slots, always a power of two.
+	 */
+	size_t nslots;
+
+	/*!
+	 * \brief Hash table slots.
+	 */
+	struct tree_index_slot *slots;
+
+	/*!
+	 * \brief Packed, zero terminated full paths of all nodes.
+	 */
+	char *paths;
+
+	/*!
+	 * \brief Used size of \c paths.
+	 */
+	size_t paths_size;
+
+	/*!
+	 * \brief Allocated size of \c paths.
+	 */
+	size_t paths_alloc;
+};
+
+/*!
+ * \brief Extent of GRAF used by a directory tree.
+ */
+struct tree_extent {
+	/*!
+	 * \brief Offset of the extent inside of GRAF.
+	 */
+	off_t offset;
+
+	/*!
+	 * \brief Size of the extent.
+	 */
+	off_t size;
+};
+
+/*!
+ * \brief Open regular file.
+ *
+ * This is what \c tree_open() stores in \c fuse_file_info::fh, it
+ * keeps the read-ahead state of the file.
+ */
+struct tree_file {
+	/*!
+	 * \brief Node of the file.
+	 */
+	struct tree *node;
+
+	/*!
+	 * \brief Read-ahead state of the file extent.
+	 */
+	struct image_readahead ra;
+};
+
+/*!
+ * \brief Compare two filenames in directory order.
+ *
+ * This is the order of XDVDFS directory tables: names are compared
+ * case-insensitively (as upper case ASCII), ties are broken by exact
+ * comparison so that the order is total.
+ *
+ * \return negative, zero or positive like \c strcmp().
+ */
+int tree_name_cmp(const char *a, const char *b);
+
+/*!
+ * \brief Function loading contents of a directory on demand.
  *
- * \param root \c tree root, at which \c path should be inserted.
- * \param path path that should be inserted. This should be relative
- * name (no '/' in the beginning). Please note that it will be
- * destroyed.
- * \param length length of \c path (as sometimes it is not zero
- * terminated).
- * \param offset offset (from \c packentry) that should be stored in
- * the tree node corresponding to given \c path.
- * \param size size (from \c packentry) that should be stored in the
- * tree node correspoding to given \c path.
+ * It should set contents of \c dir with \c tree_set_children().
+ *
+ * \param data pointer given to \c tree_set_loader().
+ * \param root \c tree root.
+ * \param dir directory to be loaded.
+ * \return 0 on success, -errno otherwise.
+ */
+typedef int (*tree_loader_t)(void *data, struct tree *root,
+			     struct tree *dir);
+
+/*!
+ * \brief Set function used by \c tree_load() to load directories.
+ *
+ * \param root \c tree root returned by \c tree_empty().
+ * \param loader loader function.
+ * \param data pointer passed to \c loader.
+ */
+void tree_set_loader(struct tree *root, tree_loader_t loader, void *data);
+
+/*!
+ * \brief Get data given to \c tree_set_loader().
+ *
+ * \param root \c tree root.
+ * \return loader data or NULL if no loader is set.
+ */
+void *tree_loader_data(struct tree *root);
+
+/*!
+ * \brief Find root of the tree containing given node.
+ *
+ * \param node any node of the tree.
+ * \return \c tree root.
+ */
+struct tree *tree_root_of(struct tree *node);
+
+/*!
+ * \brief Make sure that contents of a directory are loaded.
+ *
+ * This is safe to call from many threads at once; loading is done
+ * only once, by the loader set with \c tree_set_loader().
+ *
+ * \param root \c tree root.
+ * \param dir directory node.
+ * \return 0 on success, -errno otherwise.
  */
-void tree_insert(struct tree *root, const char *path, int length,
-		 off_t offset, long size, time_t timestamp);
+int tree_load(struct tree *root, struct tree *dir);
+
+/*!
+ * \brief Set contents of a directory in GRAF directory tree.
+ *
+ * This function creates one node for every entry, as a contiguous
+ * array owned by the tree, and connects it to \c dir. Entries are
+ * expected in \c tree_name_cmp() order (which is the order XDVDFS
+ * directory tables are traversed in) and are sorted if they are not.
+ * Directories are created not loaded, their contents should be set
+ * with another call. \c dir is marked as loaded.
+ *
+ * Contents of different directories may be set from many threads at
+ * once.
+ *
+ * \param root \c tree root returned by \c tree_empty(); nodes and
+ * names are allocated from memory owned by it.
+ * \param dir directory node, its contents must not be set yet.
+ * \param entries files to create.
+ * \param count number of \c entries.
+ * \param timestamp timestamp to be stored in new nodes.
+ * \return 0 on success or -ENOMEM if there is not enough memory.
+ */
+int tree_set_children(struct tree *root, struct tree *dir,
+		      const struct tree_entry *entries, int count,
+		      time_t timestamp);
 
 /*!
  * \brief Find given path in GRAF directory structure.
  *
+ * Directories on the way are loaded if needed.
+ *
  * \param root \c tree root, at which searching should be started.
  * \param path path to find, it should be exactly as provided by FUSE
  * (so it should start with '/').
@@ -138,21 +354,212 @@ void tree_insert(struct tree *root, const char *path, int length,
  */
 struct tree *tree_find_entry(struct tree *root, const char *path);
 
+/*!
+ * \brief Build full path index of GRAF directory structure.
+ *
+ * The tree must be completely loaded and must not be modified after
+ * the index has been built.
+ *
+ * \param root \c tree root to be indexed.
+ * \return new index or NULL if there is not enough memory.
+ */
+struct tree_index *tree_index_build(struct tree *root);
+
+/*!
+ * \brief Find given path in the full path index.
+ *
+ * \param index index built by \c tree_index_build().
+ * \param path path to find, it should be exactly as provided by FUSE
+ * (so it should start with '/').
+ * \return pointer to node containing information about given \c path
+ * or NULL if not found.
+ */
+struct tree *tree_index_find(struct tree_index *index, const char *path);
+
+/*!
+ * \brief Free full path index.
+ *
+ * \param index index to be freed, the tree itself is left untouched.
+ */
+void tree_index_free(struct tree_index *index);
+
+/*!
+ * \brief Save directory tree to a cache file.
+ *
+ * The file stores all nodes and names in a compact form, so that the
+ * tree can be rebuilt by \c tree_restore() without the disc image.
+ *
+ * \param root \c tree root, the tree must be completely loaded.
+ * \param fd file descriptor to write to.
+ * \param key data identifying the image; it is stored in the file
+ * and checked by \c tree_restore().
+ * \param key_size size of \c key.
+ * \return 0 on success, -EAGAIN if the tree is not completely loaded,
+ * other -errno otherwise.
+ */
+int tree_save(struct tree *root, int fd, const void *key, size_t key_size);
+
+/*!
+ * \brief Rebuild directory tree from a cache file.
+ *
+ * The file is memory mapped and the tree is built with one node
+ * allocation and one name pool allocation.
+ *
+ * \param fd file descriptor of a file written by \c tree_save().
+ * \param key data identifying the image, it must be equal to the key
+ * stored in the file.
+ * \param key_size size of \c key.
+ * \return new tree root or NULL if the file is not valid for \c key.
+ */
+struct tree *tree_restore(int fd, const void *key, size_t key_size);
+
 /*!
  * \brief Free entire GRAF directory hierarchy structure.
  *
- * \param root root of the directory \c tree to be freed.
+ * All nodes are freed at once without visiting them.
+ *
+ * \param root root of the directory \c tree to be freed, as returned
+ * by \c tree_empty().
  */
 void tree_free(struct tree *root);
 
+/*!
+ * \brief Get memory used by a directory tree.
+ *
+ * This may be called while directories are being loaded.
+ *
+ * \param root root of the directory \c tree.
+ * \return number of bytes allocated for the tree.
+ */
+size_t tree_memory(struct tree *root);
+
+/*!
+ * \brief Collect extents of GRAF used by a directory tree.
+ *
+ * These are the directory tables and file extents of all loaded
+ * nodes. Everything else in the image is padding (or belongs to other
+ * partitions) as far as the filesystem is concerned.
+ *
+ * \param root \c tree root, the tree should be completely loaded.
+ * \param align extents are widened to multiples of this, a power of
+ * two (e.g. the sector size).
+ * \param extents array of extents sorted by offset, with overlapping
+ * and adjacent ones merged, is stored here; it has to be freed by the
+ * caller.
+ * \return number of extents or -ENOMEM if there is not enough memory.
+ */
+int tree_extents(struct tree *root, off_t align, struct tree_extent **extents);
+
+/*!
+ * \brief Sort extents and merge overlapping and adjacent ones.
+ *
+ * \param extents extents to merge, they are merged in place.
+ * \param count number of \c extents.
+ * \param align extents are widened to multiples of this, a power of
+ * two.
+ * \return number of extents left.
+ */
+int tree_extents_merge(struct tree_extent *extents, int count, off_t align);
+
 /*!
  * \brief Create empty directory structure.
  *
  * This functions creates empty directory structures with all fields
- * set as needed.
+ * set as needed. The root owns an arena from which all nodes and
+ * names inserted later are allocated.
+ * \return the root or NULL if there is not enough memory.
  */
 struct tree *tree_empty(void);
 
+/*!
+ * \brief Find a file directly inside of given directory.
+ *
+ * This is a binary search over the sorted contents of \c dir, which
+ * has to be loaded already.
+ *
+ * \param dir directory node.
+ * \param name name of the file (no '/' allowed).
+ * \return pointer to the node or NULL if not found.
+ */
+struct tree *tree_find_child(struct tree *dir, const char *name);
+
+/*!
+ * \brief Fill stat structure for given node.
+ *
+ * Directories which are not loaded yet report one link, which tells
+ * find that the number of subdirectories is unknown.
+ *
+ * \param node node to describe.
+ * \param stbuf stats will be stored here.
+ */
+void tree_stat(struct tree *node, struct stat *stbuf);
+
+/*!
+ * \brief Read data of given file node.
+ *
+ * \param node file node.
+ * \param buf read buffer.
+ * \param size size of \c buf.
+ * \param offset read offset inside of the file.
+ * \param image disc image to read data from.
+ * \return number of bytes read on success, -errno otherwise.
+ */
+int tree_read_node(struct tree *node, char *buf, size_t size,
+		   off_t offset, struct image *image);
+
+/*!
+ * \brief Open regular file for reading.
+ *
+ * \param node file node.
+ * \param image disc image, it gets a hint about the opened extent.
+ * \return new open file or NULL if there is not enough memory.
+ */
+struct tree_file *tree_file_open(struct tree *node, struct image *image);
+
+/*!
+ * \brief Read data from an open file.
+ *
+ * Like \c tree_read_node(), but sequential reads also prefetch the
+ * data following them.
+ *
+ * \param file open file.
+ * \param buf read buffer.
+ * \param size size of \c buf.
+ * \param offset read offset inside of the file.
+ * \param image disc image to read data from.
+ * \return number of bytes read on success, -errno otherwise.
+ */
+int tree_file_read(struct tree_file *file, char *buf, size_t size,
+		   off_t offset, struct image *image);
+
+#ifdef HAVE_FUSE_READ_BUF
+/*!
+ * \brief Read data from an open file into a FUSE buffer.
+ *
+ * If the image can be spliced from (see \c image_splice_fd()), the
+ * buffer just refers to the extent in the image file, so the kernel
+ * can move the data without copying it through user space. Otherwise
+ * the data are read into allocated memory.
+ *
+ * \param file open file.
+ * \param bufv buffer to be set; if its memory is not NULL afterwards,
+ * it has to be freed by the caller.
+ * \param size number of bytes to read.
+ * \param offset read offset inside of the file.
+ * \param image disc image to read data from.
+ * \return 0 on success, -errno otherwise.
+ */
+int tree_file_read_buf(struct tree_file *file, struct fuse_bufvec *bufv,
+		       size_t size, off_t offset, struct image *image);
+#endif
+
+/*!
+ * \brief Close file opened by \c tree_file_open().
+ *
+ * \param file open file, may be NULL.
+ */
+void tree_file_close(struct tree_file *file);
+
 /*!
  * \brief FUSE getattr operation.
  *
@@ -161,55 +568,97 @@ struct tree *tree_empty(void);
  * \param path file path.
  * \param stbuf stats will be stored here.
  * \param root tree root.
+ * \param index full path index of \c root or NULL to walk the tree.
  * \param fd data file descriptor.
  * \return 0 on success, -errno otherwise.
  */
 int tree_getattr(const char *path, struct stat *stbuf, struct tree *root,
-		 int fd);
+		 struct tree_index *index, int fd);
 
 /*!
  * \brief FUSE open operation.
  *
  * This is FUSE compatible open operation which gets file
- * information from \c tree structure.
+ * information from \c tree structure. A \c tree_file of the node
+ * found is stored in \c fi->fh, so that following operations on \c fi
+ * don't need to resolve \c path again.
  * \param path file path.
  * \param fi FUSE file information.
  * \param root tree root.
+ * \param index full path index of \c root or NULL to walk the tree.
+ * \param image disc image, it gets a hint about the opened extent.
  * \return 0 on success, -errno otherwise.
  */
-int tree_open(const char *path, struct fuse_file_info *fi, struct tree *root);
+int tree_open(const char *path, struct fuse_file_info *fi, struct tree *root,
+	      struct tree_index *index, struct image *image);
+
+/*!
+ * \brief FUSE release operation.
+ *
+ * This is FUSE compatible release operation, which closes the file
+ * stored in \c fi by \c tree_open().
+ * \param path file path.
+ * \param fi FUSE file information.
+ * \return always 0.
+ */
+int tree_release(const char *path, struct fuse_file_info *fi);
 
 /*!
  * \brief FUSE read operation.
  *
  * This is FUSE compatible read operation which gets file
- * information from \c tree structure.
+ * information from \c tree structure. If \c fi was filled by
+ * \c tree_open(), \c path is not looked up at all.
  * \param path file path.
  * \param buf read buffer.
  * \param size size of \c buf.
  * \param offset read offset.
  * \param fi FUSE file information.
  * \param root tree root.
- * \param fd data file descriptor.
- * \param mutex file operations mutex related to \c fd.
+ * \param index full path index of \c root or NULL to walk the tree.
+ * \param image disc image to read data from.
  * \return number of bytes read on success, -errno otherwise.
  */
 int tree_read(const char *path, char *buf, size_t size,
 	      off_t offset, struct fuse_file_info *fi, struct tree *root,
-	      int fd, pthread_mutex_t * mutex);
+	      struct tree_index *index, struct image *image);
+
+#ifdef HAVE_FUSE_READ_BUF
+/*!
+ * \brief FUSE read_buf operation.
+ *
+ * This is FUSE compatible read_buf operation, which works like
+ * \c tree_read(), but avoids copying the data when possible (see
+ * \c tree_file_read_buf()).
+ * \param path file path.
+ * \param bufp the new buffer is stored here, FUSE frees it.
+ * \param size number of bytes to read.
+ * \param offset read offset.
+ * \param fi FUSE file information.
+ * \param root tree root.
+ * \param index full path index of \c root or NULL to walk the tree.
+ * \param image disc image to read data from.
+ * \return 0 on success, -errno otherwise.
+ */
+int tree_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+		  off_t offset, struct fuse_file_info *fi, struct tree *root,
+		  struct tree_index *index, struct image *image);
+#endif
 
 /*!
  * \brief FUSE opendir operation.
  *
  * This is FUSE compatible opendir operation which gets file
- * information from \c tree structure.
+ * information from \c tree structure. The node found is stored in
+ * \c fi->fh for \c tree_readdir().
  * \param path directory path.
  * \param fi FUSE file information.
  * \param root tree root.
+ * \param index full path index of \c root or NULL to walk the tree.
  * \return 0 on success, -errno otherwise.
  */
 int tree_opendir(const char *path, struct fuse_file_info *fi,
-		 struct tree *root);
+		 struct tree *root, struct tree_index *index);
 
 /*!
  * \brief FUSE readdir operation.
@@ -222,10 +671,12 @@ int tree_opendir(const char *path, struct fuse_file_info *fi,
  * \param offset output offset.
  * \param fi FUSE file information.
  * \param root tree root.
+ * \param index full path index of \c root or NULL to walk the tree.
  * \return 0 on success, -errno otherwise.
  */
 int tree_readdir(const char *path, void *buf,
 		 fuse_fill_dir_t filler, off_t offset,
-		 struct fuse_file_info *fi, struct tree *root);
+		 struct fuse_file_info *fi, struct tree *root,
+		 struct tree_index *index);
 
 #endif				// _TREE_H_
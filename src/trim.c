@@ -0,0 +1,268 @@
+/*
+ *  Copyright (C) 2006 Mike Melanson (mike at multimedia.cx)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*!
+ * \file trim.c
+ * \author Mike Melanson
+ * \brief Backend for trimmed images.
+ *
+ * A trimmed image keeps only the extents of the original image the
+ * filesystem uses (see \c tree_extents()), stored back to back after
+ * a remap table. Every entry of the table gives the offset and size of
+ * an extent in the original image and where it is stored in the file;
+ * everything between the extents reads as zeros. Extents are stored
+ * uncompressed and each of them in one piece, so file data can still
+ * be spliced from the image file.
+ *
+ * The file starts with a 24 byte header: the magic "XBFSTRIM", the
+ * format version and the number of extents (32 bits each) and the size
+ * of the original image (64 bits). The table of 24 byte entries (64
+ * bit offset, size and file position of each extent, sorted by offset)
+ * follows, all numbers are little-endian. xbcompress writes these.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "image.h"
+
+#define TRIM_MAGIC "XBFSTRIM"
+#define TRIM_VERSION 1
+#define TRIM_HEADER_SIZE 24
+#define TRIM_ENTRY_SIZE 24
+
+//! Treat given memory address as a 32-bit little-endian integer.
+#define TRIM_LE_32(x) ((uint32_t)(x)[0] | ((uint32_t)(x)[1] << 8) | \
+		       ((uint32_t)(x)[2] << 16) | ((uint32_t)(x)[3] << 24))
+
+//! Treat given memory address as a 64-bit little-endian integer.
+#define TRIM_LE_64(x) (TRIM_LE_32(x) | (uint64_t)TRIM_LE_32((x) + 4) << 32)
+
+struct trim_extent {
+	//! Offset in the original image.
+	off_t offset;
+	off_t size;
+	//! Offset in the image file.
+	off_t pos;
+};
+
+struct trim {
+	//! Extents sorted by offset, they never overlap.
+	struct trim_extent *extents;
+	uint32_t count;
+};
+
+// Find the first extent ending after offset, count if there is none.
+static uint32_t trim_find(struct trim *trim, off_t offset)
+{
+	uint32_t lo = 0, hi = trim->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (trim->extents[mid].offset + trim->extents[mid].size <=
+		    offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int image_trim_probe(const unsigned char *header, size_t size)
+{
+	return size >= TRIM_HEADER_SIZE &&
+		!memcmp(header, TRIM_MAGIC, strlen(TRIM_MAGIC));
+}
+
+static int image_trim_open(struct image *image)
+{
+	unsigned char header[TRIM_HEADER_SIZE], *table;
+	struct trim_extent *e;
+	struct trim *trim;
+	uint64_t total;
+	uint32_t i;
+	size_t size;
+	ssize_t ret;
+
+	ret = image_pread(image->fd, header, sizeof(header), 0);
+	if (ret < 0)
+		return ret;
+	if (ret < (ssize_t)sizeof(header))
+		return -EINVAL;
+	if (TRIM_LE_32(&header[8]) != TRIM_VERSION)
+		return -ENOTSUP;
+
+	trim = (struct trim *)calloc(1, sizeof(struct trim));
+	if (!trim)
+		return -ENOMEM;
+	trim->count = TRIM_LE_32(&header[12]);
+	total = TRIM_LE_64(&header[16]);
+
+	// image->size is still the size of the file here
+	size = (size_t)trim->count * TRIM_ENTRY_SIZE;
+	if (total > INT64_MAX ||
+	    TRIM_HEADER_SIZE + (off_t)size > image->size) {
+		free(trim);
+		return -EINVAL;
+	}
+
+	table = (unsigned char *)malloc(size);
+	trim->extents = (struct trim_extent *)malloc(trim->count *
+		sizeof(struct trim_extent) + 1);
+	if (!table || !trim->extents) {
+		free(table);
+		free(trim->extents);
+		free(trim);
+		return -ENOMEM;
+	}
+	ret = image_pread(image->fd, table, size, TRIM_HEADER_SIZE);
+	if (ret >= 0 && (size_t)ret < size)
+		ret = -EINVAL;
+
+	// extents must be sorted, apart and inside of both files
+	for (i = 0; ret >= 0 && i < trim->count; i++) {
+		e = &trim->extents[i];
+		e->offset = TRIM_LE_64(&table[i * TRIM_ENTRY_SIZE]);
+		e->size = TRIM_LE_64(&table[i * TRIM_ENTRY_SIZE + 8]);
+		e->pos = TRIM_LE_64(&table[i * TRIM_ENTRY_SIZE + 16]);
+		if (e->offset < 0 || e->size <= 0 || e->pos < 0 ||
+		    e->size > (off_t)total - e->offset ||
+		    e->size > image->size - e->pos ||
+		    (i && e->offset < e[-1].offset + e[-1].size))
+			ret = -EINVAL;
+	}
+	free(table);
+	if (ret < 0) {
+		free(trim->extents);
+		free(trim);
+		return ret;
+	}
+
+	image->priv = trim;
+	image->size = total;
+
+	return 0;
+}
+
+static ssize_t image_trim_read(struct image *image, void *buf, size_t size,
+			       off_t offset)
+{
+	struct trim *trim = (struct trim *)image->priv;
+	struct trim_extent *e;
+	size_t done = 0, want;
+	uint32_t i;
+	ssize_t ret;
+	off_t pos;
+
+	if (offset >= image->size)
+		return 0;
+	if ((off_t)size > image->size - offset)
+		size = image->size - offset;
+
+	for (i = trim_find(trim, offset); done < size; ) {
+		pos = offset + done;
+		want = size - done;
+		e = (i < trim->count) ? &trim->extents[i] : NULL;
+
+		// space between extents was trimmed away
+		if (!e || e->offset > pos) {
+			if (e && (off_t)want > e->offset - pos)
+				want = e->offset - pos;
+			memset((char *)buf + done, 0, want);
+			done += want;
+			continue;
+		}
+
+		if ((off_t)want > e->offset + e->size - pos)
+			want = e->offset + e->size - pos;
+		ret = image_pread(image->fd, (char *)buf + done, want,
+				  e->pos + (pos - e->offset));
+		if (ret >= 0 && (size_t)ret < want)
+			ret = -EIO;
+		if (ret < 0)
+			return done ? (ssize_t)done : ret;
+		done += want;
+		i++;
+	}
+
+	return done;
+}
+
+static int image_trim_map(struct image *image, off_t offset, size_t size,
+			  off_t *pos)
+{
+	struct trim *trim = (struct trim *)image->priv;
+	struct trim_extent *e;
+	uint32_t i;
+
+	i = trim_find(trim, offset);
+	if (i >= trim->count)
+		return -1;
+	e = &trim->extents[i];
+	if (e->offset > offset || offset + (off_t)size > e->offset + e->size)
+		return -1;
+
+	*pos = e->pos + (offset - e->offset);
+
+	return 0;
+}
+
+static void image_trim_prefetch(struct image *image, off_t offset,
+				off_t size)
+{
+	struct trim *trim = (struct trim *)image->priv;
+	struct trim_extent *e;
+	off_t from, to;
+	uint32_t i;
+
+	for (i = trim_find(trim, offset); i < trim->count; i++) {
+		e = &trim->extents[i];
+		if (e->offset >= offset + size)
+			break;
+		from = (e->offset > offset) ? e->offset : offset;
+		to = (e->offset + e->size < offset + size) ?
+			e->offset + e->size : offset + size;
+		posix_fadvise(image->fd, e->pos + (from - e->offset),
+			      to - from, POSIX_FADV_WILLNEED);
+	}
+}
+
+static void image_trim_close(struct image *image)
+{
+	struct trim *trim = (struct trim *)image->priv;
+
+	free(trim->extents);
+	free(trim);
+}
+
+const struct image_backend image_trim_backend = {
+	.name = "trim",
+	.probe = image_trim_probe,
+	.open = image_trim_open,
+	.read = image_trim_read,
+	.map = image_trim_map,
+	.prefetch = image_trim_prefetch,
+	.close = image_trim_close,
+};
@@ -0,0 +1,772 @@
+/*
+ *  Copyright (C) 2006 Mike Melanson (mike at multimedia.cx)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*!
+ * \file xbcompress.c
+ * \author Mike Melanson
+ * \brief Compress Xbox/360 DVD images into CSO or ZSO images, or trim
+ * them.
+ *
+ * The directory tree of the image is read first, and every sector it
+ * refers to (the volume descriptor, directory tables and file extents)
+ * is marked as used. Blocks without used sectors and blocks holding
+ * only zeros all get a copy of one compressed block of zeros, so they
+ * take a few bytes each and the output stays a standard CSO or ZSO
+ * image. Unused sectors of other blocks are zeroed so that they
+ * compress to almost nothing.
+ * Blocks are compressed by a pool of threads and written in order by
+ * the main thread.
+ *
+ * Trimmed images (see trim.c) just get the used extents copied.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "tree.h"
+#include "xdvdfs.h"
+
+#include <getopt.h>
+#include <stdint.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#define SECTOR_SIZE 2048ULL
+
+// size of the file header, the index follows it
+#define XBC_HEADER_SIZE 24
+
+// top bit of an index entry, set for blocks stored uncompressed
+#define XBC_INDEX_FLAG 0x80000000u
+
+#define XBC_BLOCK_SIZE (16 * 1024)
+#define XBC_BLOCK_MAX (16 * 1024 * 1024)
+
+// blocks being compressed or waiting to be written, per thread
+#define XBC_WINDOW_PER_THREAD 8
+
+#define XBC_TRIM_MAGIC "XBFSTRIM"
+#define XBC_TRIM_VERSION 1
+#define XBC_TRIM_HEADER_SIZE 24
+#define XBC_TRIM_ENTRY_SIZE 24
+
+/*!
+ * \brief Flag indicating wheter we should run in quiet mode (0 - no,
+ * all other values - yes).
+ *
+ * Only the progress of the compression is reported, the filesystem
+ * code prints errors only.
+ */
+int quiet = 1;
+
+enum xbc_format {
+	XBC_CSO,
+	XBC_ZSO,
+	XBC_TRIM,
+};
+
+enum xbc_kind {
+	XBC_COMPRESSED,
+	XBC_STORED,
+	XBC_ZERO,
+	XBC_UNUSED,
+};
+
+// One block of the window.
+struct xbc_block {
+	//! Output data, with room for padding to the index alignment.
+	char *data;
+	//! Size of \c data without padding.
+	size_t len;
+	enum xbc_kind kind;
+	//! Set by the worker once \c data are complete.
+	int ready;
+};
+
+struct xbc {
+	enum xbc_format format;
+	int level;
+	//! Source image.
+	struct image *image;
+	//! Size of the image contents.
+	off_t total;
+	uint32_t block_size;
+	uint32_t nblocks;
+	//! Used sectors, one bit each; NULL keeps all data.
+	unsigned char *used;
+	off_t nsectors;
+	//! Room needed in \c xbc_block::data.
+	size_t capacity;
+	//! Whole block of zeros, compressed.
+	char *zero;
+	//! Size of \c zero, 0 if zeros can't be compressed.
+	size_t zero_len;
+
+	//! Blocks \c written to \c written + \c window - 1 have a slot.
+	struct xbc_block *slots;
+	uint32_t window;
+
+	pthread_mutex_t lock;
+	//! Signalled when a block is ready.
+	pthread_cond_t ready;
+	//! Signalled when a block has been written.
+	pthread_cond_t space;
+	//! Next block to be compressed.
+	uint32_t next;
+	//! Number of blocks written.
+	uint32_t written;
+	//! First error of a worker, 0 if none.
+	int error;
+};
+
+static void xbc_mark(struct xbc *xbc, off_t offset, off_t size)
+{
+	off_t sector, last;
+
+	if (size <= 0 || offset < 0 || offset >= xbc->total)
+		return;
+
+	last = (offset + size - 1) / SECTOR_SIZE;
+	if (last >= xbc->nsectors)
+		last = xbc->nsectors - 1;
+	for (sector = offset / SECTOR_SIZE; sector <= last; sector++)
+		xbc->used[sector >> 3] |= 1 << (sector & 7);
+}
+
+/*!
+ * \brief Get extents of the image used by the filesystem.
+ *
+ * \param xbfs loaded image.
+ * \param total size of the image.
+ * \param extents sorted, sector aligned extents (cut at the end of the
+ * image) are stored here.
+ * \return number of extents or -ENOMEM.
+ */
+static int xbc_extents(struct xbfsfile *xbfs, off_t total,
+		       struct tree_extent **extents)
+{
+	struct tree_extent *e;
+	int count;
+
+	count = tree_extents(xbfs->tree, SECTOR_SIZE, extents);
+	if (count < 0)
+		return count;
+
+	// the volume descriptor and the sectors before it
+	e = (struct tree_extent *)realloc(*extents, (count + 1) *
+					  sizeof(struct tree_extent));
+	if (!e) {
+		free(*extents);
+		return -ENOMEM;
+	}
+	e[count].offset = xbfs->base_offset;
+	e[count].size = 33 * SECTOR_SIZE;
+	count = tree_extents_merge(e, count + 1, SECTOR_SIZE);
+
+	// tables may claim more than there is
+	while (count && e[count - 1].offset >= total)
+		count--;
+	if (count && e[count - 1].offset + e[count - 1].size > total)
+		e[count - 1].size = total - e[count - 1].offset;
+
+	*extents = e;
+
+	return count;
+}
+
+static inline int xbc_sector_used(struct xbc *xbc, off_t sector)
+{
+	return xbc->used[sector >> 3] & (1 << (sector & 7));
+}
+
+static inline int xbc_is_zero(const char *buf, size_t size)
+{
+	return !size || (!buf[0] && !memcmp(buf, buf + 1, size - 1));
+}
+
+// Per-thread compressor state.
+struct xbc_worker {
+	struct xbc *xbc;
+	pthread_t thread;
+	//! Uncompressed block.
+	char *in;
+#ifdef HAVE_ZLIB
+	z_stream z;
+#endif
+};
+
+// Compress size bytes of the worker's input into out, which holds
+// xbc->capacity bytes. Returns the compressed size, or 0 if the data
+// doesn't get smaller.
+static size_t xbc_pack(struct xbc_worker *worker, size_t size, char *out)
+{
+	int len = 0;
+
+#ifdef HAVE_ZLIB
+	if (worker->xbc->format == XBC_CSO) {
+		deflateReset(&worker->z);
+		worker->z.next_in = (Bytef *)worker->in;
+		worker->z.avail_in = size;
+		worker->z.next_out = (Bytef *)out;
+		worker->z.avail_out = worker->xbc->capacity;
+		if (deflate(&worker->z, Z_FINISH) == Z_STREAM_END)
+			len = worker->xbc->capacity - worker->z.avail_out;
+	}
+#endif
+#ifdef HAVE_LZ4
+	if (worker->xbc->format == XBC_ZSO)
+		len = LZ4_compress_default(worker->in, out, size,
+					   worker->xbc->capacity);
+#endif
+
+	return (len <= 0 || (size_t)len >= size) ? 0 : len;
+}
+
+// Compress one block into its slot.
+static int xbc_compress(struct xbc_worker *worker, uint32_t block,
+			struct xbc_block *slot)
+{
+	struct xbc *xbc = worker->xbc;
+	off_t offset = (off_t)block * xbc->block_size, sector;
+	size_t size = xbc->block_size, i;
+	enum xbc_kind kind = XBC_ZERO;
+
+	if (offset + (off_t)size > xbc->total)
+		size = xbc->total - offset;
+
+	if (xbc->used) {
+		for (i = 0; i < size; i += SECTOR_SIZE)
+			if (xbc_sector_used(xbc, (offset + i) / SECTOR_SIZE))
+				break;
+		if (i >= size)
+			kind = XBC_UNUSED;
+	}
+
+	if (kind == XBC_UNUSED)
+		memset(worker->in, 0, size);
+	else if (image_read(xbc->image, worker->in, size, offset) !=
+		 (ssize_t)size)
+		return -EIO;
+
+	// padding between files is often random data, which would not
+	// compress at all
+	if (xbc->used && kind != XBC_UNUSED)
+		for (i = 0; i < size; i += SECTOR_SIZE) {
+			sector = (offset + i) / SECTOR_SIZE;
+			if (!xbc_sector_used(xbc, sector))
+				memset(worker->in + i, 0,
+				       (size - i < SECTOR_SIZE) ?
+				       size - i : SECTOR_SIZE);
+		}
+
+	if (kind == XBC_UNUSED || xbc_is_zero(worker->in, size)) {
+		slot->kind = kind;
+		if (xbc->zero_len && size == xbc->block_size) {
+			memcpy(slot->data, xbc->zero, xbc->zero_len);
+			slot->len = xbc->zero_len;
+			return 0;
+		}
+	} else
+		slot->kind = XBC_COMPRESSED;
+
+	// blocks which don't get smaller are stored as they are
+	slot->len = xbc_pack(worker, size, slot->data);
+	if (!slot->len) {
+		memcpy(slot->data, worker->in, size);
+		slot->len = size;
+		slot->kind = XBC_STORED;
+	}
+
+	return 0;
+}
+
+static void *xbc_worker(void *data)
+{
+	struct xbc_worker *worker = (struct xbc_worker *)data;
+	struct xbc *xbc = worker->xbc;
+	struct xbc_block *slot;
+	uint32_t block;
+	int ret;
+
+	pthread_mutex_lock(&xbc->lock);
+	for (;;) {
+		// don't run too far ahead of the writer
+		while (!xbc->error && xbc->next < xbc->nblocks &&
+		       xbc->next - xbc->written >= xbc->window)
+			pthread_cond_wait(&xbc->space, &xbc->lock);
+		if (xbc->error || xbc->next >= xbc->nblocks)
+			break;
+		block = xbc->next++;
+		slot = &xbc->slots[block % xbc->window];
+		pthread_mutex_unlock(&xbc->lock);
+
+		ret = xbc_compress(worker, block, slot);
+
+		pthread_mutex_lock(&xbc->lock);
+		if (ret && !xbc->error)
+			xbc->error = ret;
+		slot->ready = 1;
+		pthread_cond_broadcast(&xbc->ready);
+	}
+	pthread_mutex_unlock(&xbc->lock);
+
+	return NULL;
+}
+
+static inline void xbc_put_le_32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/*!
+ * \brief Compress the image into an open output file.
+ *
+ * \return 0 on success, -errno otherwise.
+ */
+static int xbc_run(struct xbc *xbc, int fd, int nthreads)
+{
+	unsigned long long counts[XBC_UNUSED + 1] = { 0 };
+	struct xbc_worker *workers;
+	struct xbc_block *slot;
+	unsigned char *index;
+	off_t pos, end, align;
+	uint32_t block;
+	int shift, started, percent = -1, ret = 0, i;
+
+	// the index holds offsets shifted right, as little as possible
+	// while every block (stored ones padded to the alignment) fits
+	pos = XBC_HEADER_SIZE + ((off_t)xbc->nblocks + 1) * 4;
+	for (shift = 0; shift < 31; shift++) {
+		end = pos + (1 << shift) + xbc->total +
+			(off_t)xbc->nblocks * ((1 << shift) - 1);
+		if (end >> shift < XBC_INDEX_FLAG)
+			break;
+	}
+	align = (off_t)1 << shift;
+	pos = (pos + align - 1) & ~(align - 1);
+
+	index = (unsigned char *)malloc(XBC_HEADER_SIZE +
+					((size_t)xbc->nblocks + 1) * 4);
+	xbc->zero = (char *)malloc(xbc->capacity);
+	xbc->slots = (struct xbc_block *)calloc(xbc->window,
+						sizeof(struct xbc_block));
+	workers = (struct xbc_worker *)calloc(nthreads,
+					      sizeof(struct xbc_worker));
+	if (!index || !xbc->zero || !xbc->slots || !workers)
+		ret = -ENOMEM;
+	for (i = 0; !ret && i < (int)xbc->window; i++) {
+		xbc->slots[i].data = (char *)malloc(xbc->capacity + align);
+		if (!xbc->slots[i].data)
+			ret = -ENOMEM;
+	}
+
+	pthread_mutex_init(&xbc->lock, NULL);
+	pthread_cond_init(&xbc->ready, NULL);
+	pthread_cond_init(&xbc->space, NULL);
+
+	for (started = 0; !ret && started < nthreads; started++) {
+		workers[started].xbc = xbc;
+		workers[started].in = (char *)malloc(xbc->block_size);
+		if (!workers[started].in) {
+			ret = -ENOMEM;
+			break;
+		}
+#ifdef HAVE_ZLIB
+		if (xbc->format == XBC_CSO &&
+		    deflateInit2(&workers[started].z, xbc->level, Z_DEFLATED,
+				 -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			free(workers[started].in);
+			ret = -ENOMEM;
+			break;
+		}
+#endif
+		// the first worker compresses the block of zeros before
+		// any thread starts
+		if (!started) {
+			memset(workers[0].in, 0, xbc->block_size);
+			xbc->zero_len = xbc_pack(&workers[0], xbc->block_size,
+						 xbc->zero);
+		}
+		if (pthread_create(&workers[started].thread, NULL, xbc_worker,
+				   &workers[started])) {
+#ifdef HAVE_ZLIB
+			if (xbc->format == XBC_CSO)
+				deflateEnd(&workers[started].z);
+#endif
+			free(workers[started].in);
+			ret = -EAGAIN;
+			break;
+		}
+	}
+
+	for (block = 0; !ret && block < xbc->nblocks; block++) {
+		slot = &xbc->slots[block % xbc->window];
+		pthread_mutex_lock(&xbc->lock);
+		while (!slot->ready && !xbc->error)
+			pthread_cond_wait(&xbc->ready, &xbc->lock);
+		ret = xbc->error;
+		pthread_mutex_unlock(&xbc->lock);
+		if (ret)
+			break;
+
+		xbc_put_le_32(&index[XBC_HEADER_SIZE + block * 4],
+			      (pos >> shift) | (slot->kind == XBC_STORED ?
+						XBC_INDEX_FLAG : 0));
+		counts[slot->kind]++;
+		if (slot->len) {
+			end = (pos + slot->len + align - 1) & ~(align - 1);
+			memset(slot->data + slot->len, 0, end - pos - slot->len);
+			ret = image_pwrite(fd, slot->data, end - pos, pos);
+			if (ret)
+				break;
+			pos = end;
+		}
+
+		pthread_mutex_lock(&xbc->lock);
+		slot->ready = 0;
+		xbc->written++;
+		pthread_cond_broadcast(&xbc->space);
+		pthread_mutex_unlock(&xbc->lock);
+
+		if (!quiet && (block + 1) * 100ULL / xbc->nblocks != percent) {
+			percent = (block + 1) * 100ULL / xbc->nblocks;
+			fprintf(stderr, "\r%d%%", percent);
+		}
+	}
+	if (!quiet && percent >= 0)
+		fprintf(stderr, "\n");
+
+	// stop the workers on errors
+	pthread_mutex_lock(&xbc->lock);
+	if (ret && !xbc->error)
+		xbc->error = ret;
+	pthread_cond_broadcast(&xbc->space);
+	pthread_mutex_unlock(&xbc->lock);
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+#ifdef HAVE_ZLIB
+		if (xbc->format == XBC_CSO)
+			deflateEnd(&workers[i].z);
+#endif
+		free(workers[i].in);
+	}
+
+	if (!ret) {
+		memcpy(index, xbc->format == XBC_ZSO ? "ZISO" : "CISO", 4);
+		xbc_put_le_32(&index[4], XBC_HEADER_SIZE);
+		xbc_put_le_32(&index[8], (uint64_t)xbc->total);
+		xbc_put_le_32(&index[12], (uint64_t)xbc->total >> 32);
+		xbc_put_le_32(&index[16], xbc->block_size);
+		index[20] = 1;
+		index[21] = shift;
+		index[22] = 0;
+		index[23] = 0;
+		xbc_put_le_32(&index[XBC_HEADER_SIZE + xbc->nblocks * 4],
+			      pos >> shift);
+		ret = image_pwrite(fd, index, XBC_HEADER_SIZE +
+				((size_t)xbc->nblocks + 1) * 4, 0);
+	}
+
+	if (!ret && !quiet)
+		fprintf(stderr, "%u blocks: %llu compressed, %llu stored, "
+			"%llu zero, %llu unused; %lld -> %lld bytes\n",
+			xbc->nblocks, counts[XBC_COMPRESSED],
+			counts[XBC_STORED], counts[XBC_ZERO],
+			counts[XBC_UNUSED], (long long)xbc->total,
+			(long long)pos);
+
+	pthread_cond_destroy(&xbc->space);
+	pthread_cond_destroy(&xbc->ready);
+	pthread_mutex_destroy(&xbc->lock);
+	for (i = 0; xbc->slots && i < (int)xbc->window; i++)
+		free(xbc->slots[i].data);
+	free(xbc->slots);
+	free(xbc->zero);
+	free(workers);
+	free(index);
+
+	return ret;
+}
+
+/*!
+ * \brief Write trimmed image with given extents into an open file.
+ *
+ * \return 0 on success, -errno otherwise.
+ */
+static int xbc_trim(struct xbc *xbc, struct tree_extent *extents, int count,
+		    int fd)
+{
+	unsigned char *table, *entry;
+	off_t pos, done = 0, used = 0;
+	int percent = -1, ret = 0, i;
+	char *buf = NULL;
+
+	table = (unsigned char *)malloc(XBC_TRIM_HEADER_SIZE +
+					(size_t)count * XBC_TRIM_ENTRY_SIZE);
+	if (!table)
+		return -ENOMEM;
+
+	memcpy(table, XBC_TRIM_MAGIC, 8);
+	xbc_put_le_32(&table[8], XBC_TRIM_VERSION);
+	xbc_put_le_32(&table[12], count);
+	xbc_put_le_32(&table[16], (uint64_t)xbc->total);
+	xbc_put_le_32(&table[20], (uint64_t)xbc->total >> 32);
+
+	for (i = 0; i < count; i++)
+		used += extents[i].size;
+
+	// extents stay sector aligned in the file
+	pos = XBC_TRIM_HEADER_SIZE + (off_t)count * XBC_TRIM_ENTRY_SIZE;
+	pos = (pos + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
+	for (i = 0; !ret && i < count; i++) {
+		entry = &table[XBC_TRIM_HEADER_SIZE + i * XBC_TRIM_ENTRY_SIZE];
+		xbc_put_le_32(&entry[0], (uint64_t)extents[i].offset);
+		xbc_put_le_32(&entry[4], (uint64_t)extents[i].offset >> 32);
+		xbc_put_le_32(&entry[8], (uint64_t)extents[i].size);
+		xbc_put_le_32(&entry[12], (uint64_t)extents[i].size >> 32);
+		xbc_put_le_32(&entry[16], (uint64_t)pos);
+		xbc_put_le_32(&entry[20], (uint64_t)pos >> 32);
+
+		ret = image_copy(xbc->image, extents[i].offset,
+				 extents[i].size, fd, pos, &buf);
+		pos = (pos + extents[i].size + SECTOR_SIZE - 1) &
+			~(SECTOR_SIZE - 1);
+		done += extents[i].size;
+
+		if (!quiet && done * 100 / used != percent) {
+			percent = done * 100 / used;
+			fprintf(stderr, "\r%d%%", percent);
+		}
+	}
+	if (!quiet && percent >= 0)
+		fprintf(stderr, "\n");
+
+	if (!ret)
+		ret = image_pwrite(fd, table, XBC_TRIM_HEADER_SIZE +
+				(size_t)count * XBC_TRIM_ENTRY_SIZE, 0);
+
+	if (!ret && !quiet)
+		fprintf(stderr, "%d extents, %lld of %lld bytes used\n",
+			count, (long long)used, (long long)xbc->total);
+
+	free(buf);
+	free(table);
+
+	return ret;
+}
+
+static void xbc_usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [<options>] <image_file> <output_file>\n\n",
+		name);
+	fprintf(stderr, "Available options:\n");
+	fprintf(stderr,
+		"\t-f cso|zso|trim - output format: deflate (CSO) or LZ4 (ZSO)\n"
+		"\t   blocks, or only the used data uncompressed (default: %s)\n",
+#ifdef HAVE_ZLIB
+		"cso"
+#else
+		"zso"
+#endif
+		);
+	fprintf(stderr,
+		"\t-b SIZE - block size, a power of two (default: %d)\n",
+		XBC_BLOCK_SIZE);
+	fprintf(stderr,
+		"\t-l LEVEL - deflate compression level, 1-9 (default: 9)\n");
+	fprintf(stderr,
+		"\t-j N - compress with N threads (default: number of CPUs)\n");
+	fprintf(stderr,
+		"\t-k - keep data not referenced by the filesystem\n");
+	fprintf(stderr,
+		"\t-q - quiet mode (print only error messages)\n");
+	exit(EXIT_FAILURE);
+}
+
+/*!
+ * \brief Main function.
+ */
+int main(int argc, char *argv[])
+{
+	struct tree_extent *extents = NULL;
+	struct xbfsfile *xbfs;
+	struct xbc xbc;
+	int keep = 0, progress = 1, nthreads, fd, c, ret, count = 0, i;
+	char *end;
+
+	memset(&xbc, 0, sizeof(xbc));
+#ifdef HAVE_ZLIB
+	xbc.format = XBC_CSO;
+#else
+	xbc.format = XBC_ZSO;
+#endif
+	xbc.level = 9;
+	xbc.block_size = XBC_BLOCK_SIZE;
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt(argc, argv, "f:b:l:j:kq")) != -1) {
+		switch (c) {
+		case 'f':
+			if (!strcmp(optarg, "cso"))
+				xbc.format = XBC_CSO;
+			else if (!strcmp(optarg, "zso"))
+				xbc.format = XBC_ZSO;
+			else if (!strcmp(optarg, "trim"))
+				xbc.format = XBC_TRIM;
+			else
+				xbc_usage(argv[0]);
+			break;
+		case 'b':
+			xbc.block_size = strtoul(optarg, &end, 10);
+			if (*end || xbc.block_size < SECTOR_SIZE ||
+			    xbc.block_size > XBC_BLOCK_MAX ||
+			    (xbc.block_size & (xbc.block_size - 1))) {
+				fprintf(stderr, "invalid block size: %s\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'l':
+			xbc.level = atoi(optarg);
+			if (xbc.level < 1 || xbc.level > 9) {
+				fprintf(stderr, "invalid level: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1) {
+				fprintf(stderr, "invalid number of threads: %s\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'q':
+			progress = 0;
+			break;
+		default:
+			xbc_usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		xbc_usage(argv[0]);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (keep && xbc.format == XBC_TRIM) {
+		fprintf(stderr, "-k can't be used to trim images\n");
+		exit(EXIT_FAILURE);
+	}
+
+#ifndef HAVE_ZLIB
+	if (xbc.format == XBC_CSO) {
+		fprintf(stderr, "built without zlib, CSO is not available\n");
+		exit(EXIT_FAILURE);
+	}
+#endif
+#ifndef HAVE_LZ4
+	if (xbc.format == XBC_ZSO) {
+		fprintf(stderr, "built without liblz4, ZSO is not available\n");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	// the whole tree is needed, its tables are read in parallel too
+	xbfs_options.load_threads = nthreads;
+	xbfs = xbfs_load(fd, NULL, NULL);
+	if (!xbfs)
+		exit(EXIT_FAILURE);
+	quiet = !progress;
+
+	xbc.image = xbfs->image;
+	xbc.total = xbfs->image->size;
+	xbc.nblocks = (xbc.total + xbc.block_size - 1) / xbc.block_size;
+	if (xbc.total > (off_t)xbc.block_size * UINT32_MAX) {
+		fprintf(stderr, "image too large for block size %u\n",
+			xbc.block_size);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!keep) {
+		count = xbc_extents(xbfs, xbc.total, &extents);
+		xbc.nsectors = (xbc.total + SECTOR_SIZE - 1) / SECTOR_SIZE;
+		if (xbc.format != XBC_TRIM)
+			xbc.used = (unsigned char *)calloc(
+				(xbc.nsectors + 7) / 8, 1);
+		if (count < 0 || (xbc.format != XBC_TRIM && !xbc.used)) {
+			fprintf(stderr, "not enough memory\n");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; xbc.used && i < count; i++)
+			xbc_mark(&xbc, extents[i].offset, extents[i].size);
+	}
+
+	xbc.capacity = xbc.block_size;
+#ifdef HAVE_ZLIB
+	if (xbc.format == XBC_CSO)
+		xbc.capacity = compressBound(xbc.block_size);
+#endif
+#ifdef HAVE_LZ4
+	if (xbc.format == XBC_ZSO)
+		xbc.capacity = LZ4_compressBound(xbc.block_size);
+#endif
+	xbc.window = nthreads * XBC_WINDOW_PER_THREAD;
+
+	fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(argv[optind + 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (xbc.format == XBC_TRIM)
+		ret = xbc_trim(&xbc, extents, count, fd);
+	else
+		ret = xbc_run(&xbc, fd, nthreads);
+	if (!ret && close(fd))
+		ret = -errno;
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind + 1], strerror(-ret));
+		unlink(argv[optind + 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	free(xbc.used);
+	free(extents);
+	xbfs_unload(xbfs);
+
+	return EXIT_SUCCESS;
+}
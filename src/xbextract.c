@@ -0,0 +1,745 @@
+/*
+ *  Copyright (C) 2006 Mike Melanson (mike at multimedia.cx)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*!
+ * \file xbextract.c
+ * \author Mike Melanson
+ * \brief Extract all files of Xbox/360 DVD images.
+ *
+ * All directories are created first. Files are then split into chunks
+ * and the chunks are sorted by their offset in the image, so that the
+ * threads copying them read the image (almost) sequentially, however
+ * the files are scattered over the directories. Chunks of plain and
+ * trimmed images are copied by the kernel (see \c image_copy()).
+ *
+ * The files can be written to standard output as a tar archive
+ * instead, also in the order they are stored in the image. Long names
+ * and large files get POSIX (pax) extended headers.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "tree.h"
+#include "xdvdfs.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/sendfile.h>
+
+// files are copied in pieces of this size
+#define XBE_CHUNK_SIZE (16 * 1024 * 1024)
+
+#define XBE_TAR_BLOCK 512
+
+// largest size the octal size field of a tar header can hold
+#define XBE_TAR_SIZE_MAX 077777777777LL
+
+// largest amount of data passed to one sendfile() call
+#define XBE_SENDFILE_MAX (1 << 30)
+
+/*!
+ * \brief Flag indicating wheter we should run in quiet mode (0 - no,
+ * all other values - yes).
+ *
+ * Only the progress of the extraction is reported, the filesystem
+ * code prints errors only.
+ */
+int quiet = 1;
+
+// One file to be extracted.
+struct xbe_file {
+	struct tree *node;
+	//! Output path.
+	char *path;
+	//! Protects the fields below.
+	pthread_mutex_t lock;
+	//! Output file descriptor, -1 while it is not open.
+	int fd;
+	//! Chunks not copied yet, the file is closed after the last one.
+	off_t left;
+	//! Flag indicating that the file could not be written.
+	int failed;
+};
+
+// One piece of a file, the unit of work of the threads.
+struct xbe_chunk {
+	struct xbe_file *file;
+	//! Offset inside of the file.
+	off_t offset;
+	off_t size;
+};
+
+struct xbe {
+	struct image *image;
+	time_t timestamp;
+
+	struct xbe_file *files;
+	int nfiles;
+	int files_alloc;
+
+	//! Directories in tree order, so parents come first.
+	char **dirs;
+	int ndirs;
+	int dirs_alloc;
+
+	//! Chunks sorted by their offset in the image.
+	struct xbe_chunk *chunks;
+	size_t nchunks;
+
+	pthread_mutex_t lock;
+	//! Next chunk to be copied.
+	size_t next;
+	//! Bytes copied, for the progress report.
+	off_t done;
+	//! Bytes to copy in total.
+	off_t total;
+	int percent;
+	//! Number of files which failed.
+	int errors;
+};
+
+// Names come straight from the image, they must not leave the output
+// directory.
+static int xbe_name_ok(const char *name)
+{
+	return name[0] && strcmp(name, ".") && strcmp(name, "..") &&
+		!strchr(name, '/');
+}
+
+/*!
+ * \brief Collect directories and files below \c dir.
+ *
+ * \return 0 on success, -1 if there is not enough memory.
+ */
+static int xbe_collect(struct xbe *xbe, struct tree *dir, const char *path)
+{
+	struct tree *node;
+	char *sub;
+	void *p;
+	int i;
+
+	if (!dir->loaded)
+		return 0;
+
+	for (i = 0; i < dir->nsub; i++) {
+		node = &dir->sub[i];
+		if (!xbe_name_ok(node->name)) {
+			fprintf(stderr, "skipping invalid name in %s\n", path);
+			xbe->errors++;
+			continue;
+		}
+		if (asprintf(&sub, "%s/%s", path, node->name) < 0)
+			return -1;
+
+		if (node->is_dir) {
+			if (xbe->ndirs == xbe->dirs_alloc) {
+				xbe->dirs_alloc = xbe->dirs_alloc ?
+					xbe->dirs_alloc * 2 : 64;
+				p = realloc(xbe->dirs, xbe->dirs_alloc *
+					    sizeof(char *));
+				if (!p) {
+					free(sub);
+					return -1;
+				}
+				xbe->dirs = (char **)p;
+			}
+			xbe->dirs[xbe->ndirs++] = sub;
+			if (xbe_collect(xbe, node, sub))
+				return -1;
+			continue;
+		}
+
+		if (xbe->nfiles == xbe->files_alloc) {
+			xbe->files_alloc = xbe->files_alloc ?
+				xbe->files_alloc * 2 : 256;
+			p = realloc(xbe->files, xbe->files_alloc *
+				    sizeof(struct xbe_file));
+			if (!p) {
+				free(sub);
+				return -1;
+			}
+			xbe->files = (struct xbe_file *)p;
+		}
+		xbe->files[xbe->nfiles].node = node;
+		xbe->files[xbe->nfiles].path = sub;
+		xbe->nfiles++;
+	}
+
+	return 0;
+}
+
+//! \c qsort() comparison function for chunks.
+static int xbe_chunk_cmp(const void *a, const void *b)
+{
+	const struct xbe_chunk *x = (const struct xbe_chunk *)a;
+	const struct xbe_chunk *y = (const struct xbe_chunk *)b;
+	off_t ox = x->file->node->offset + x->offset;
+	off_t oy = y->file->node->offset + y->offset;
+
+	return (ox > oy) - (ox < oy);
+}
+
+// Split files into chunks sorted by offset.
+static int xbe_plan(struct xbe *xbe)
+{
+	struct xbe_file *file;
+	size_t n = 0;
+	off_t offset;
+	int i;
+
+	for (i = 0; i < xbe->nfiles; i++) {
+		file = &xbe->files[i];
+		// empty files get one empty chunk, which creates them
+		file->left = (file->node->size + XBE_CHUNK_SIZE - 1) /
+			XBE_CHUNK_SIZE;
+		if (!file->left)
+			file->left = 1;
+		file->fd = -1;
+		file->failed = 0;
+		pthread_mutex_init(&file->lock, NULL);
+		xbe->nchunks += file->left;
+		xbe->total += file->node->size;
+	}
+
+	xbe->chunks = (struct xbe_chunk *)malloc(xbe->nchunks *
+						 sizeof(struct xbe_chunk) + 1);
+	if (!xbe->chunks)
+		return -1;
+
+	for (i = 0; i < xbe->nfiles; i++) {
+		file = &xbe->files[i];
+		offset = 0;
+		do {
+			xbe->chunks[n].file = file;
+			xbe->chunks[n].offset = offset;
+			xbe->chunks[n].size = file->node->size - offset;
+			if (xbe->chunks[n].size > XBE_CHUNK_SIZE)
+				xbe->chunks[n].size = XBE_CHUNK_SIZE;
+			offset += xbe->chunks[n].size;
+			n++;
+		} while (offset < file->node->size);
+	}
+
+	qsort(xbe->chunks, xbe->nchunks, sizeof(struct xbe_chunk),
+	      xbe_chunk_cmp);
+
+	return 0;
+}
+
+//! Set modification time of an extracted file or directory.
+static void xbe_set_time(struct xbe *xbe, int fd, const char *path)
+{
+	struct timespec times[2];
+
+	times[0].tv_sec = xbe->timestamp;
+	times[0].tv_nsec = 0;
+	times[1] = times[0];
+	if (fd >= 0)
+		futimens(fd, times);
+	else
+		utimensat(AT_FDCWD, path, times, 0);
+}
+
+// Copy one chunk, opening its file first if needed.
+static void xbe_copy(struct xbe *xbe, struct xbe_chunk *chunk, char **buf)
+{
+	struct xbe_file *file = chunk->file;
+	int ret = 0, fd;
+
+	pthread_mutex_lock(&file->lock);
+	if (file->fd < 0 && !file->failed) {
+		file->fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC |
+				O_NOFOLLOW, 0644);
+		if (file->fd < 0) {
+			perror(file->path);
+			file->failed = 1;
+		}
+	}
+	fd = file->fd;
+	pthread_mutex_unlock(&file->lock);
+
+	if (fd >= 0 && chunk->size) {
+		ret = image_copy(xbe->image,
+				 chunk->file->node->offset + chunk->offset,
+				 chunk->size, fd, chunk->offset, buf);
+		if (ret)
+			fprintf(stderr, "%s: %s\n", file->path,
+				strerror(-ret));
+	}
+
+	pthread_mutex_lock(&file->lock);
+	if (ret)
+		file->failed = 1;
+	if (--file->left || file->fd < 0) {
+		pthread_mutex_unlock(&file->lock);
+		return;
+	}
+	if (!file->failed)
+		xbe_set_time(xbe, file->fd, NULL);
+	if (close(file->fd)) {
+		perror(file->path);
+		file->failed = 1;
+	}
+	file->fd = -1;
+	pthread_mutex_unlock(&file->lock);
+}
+
+static void *xbe_worker(void *data)
+{
+	struct xbe *xbe = (struct xbe *)data;
+	struct xbe_chunk *chunk;
+	char *buf = NULL;
+
+	pthread_mutex_lock(&xbe->lock);
+	while (xbe->next < xbe->nchunks) {
+		chunk = &xbe->chunks[xbe->next++];
+		pthread_mutex_unlock(&xbe->lock);
+
+		xbe_copy(xbe, chunk, &buf);
+
+		pthread_mutex_lock(&xbe->lock);
+		xbe->done += chunk->size;
+		if (!quiet && xbe->total &&
+		    xbe->done * 100 / xbe->total != xbe->percent) {
+			xbe->percent = xbe->done * 100 / xbe->total;
+			fprintf(stderr, "\r%d%%", xbe->percent);
+		}
+	}
+	pthread_mutex_unlock(&xbe->lock);
+
+	free(buf);
+
+	return NULL;
+}
+
+/*!
+ * \brief Extract all files with given number of threads.
+ *
+ * \return 0 on success, -1 if anything could not be extracted.
+ */
+static int xbe_run(struct xbe *xbe, int nthreads)
+{
+	pthread_t *threads;
+	int started, i;
+
+	threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+	if (!threads)
+		return -1;
+
+	xbe->percent = -1;
+	pthread_mutex_init(&xbe->lock, NULL);
+	for (started = 0; started < nthreads; started++)
+		if (pthread_create(&threads[started], NULL, xbe_worker, xbe))
+			break;
+	// with no thread at all, extract in this one
+	if (!started)
+		xbe_worker(xbe);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&xbe->lock);
+	free(threads);
+
+	if (!quiet && xbe->percent >= 0)
+		fprintf(stderr, "\n");
+
+	for (i = 0; i < xbe->nfiles; i++) {
+		if (xbe->files[i].failed)
+			xbe->errors++;
+		pthread_mutex_destroy(&xbe->files[i].lock);
+	}
+
+	// creating files changed the times of their directories, so
+	// these are set last, children first
+	for (i = xbe->ndirs - 1; i >= 0; i--)
+		xbe_set_time(xbe, -1, xbe->dirs[i]);
+
+	return xbe->errors ? -1 : 0;
+}
+
+//! Write whole buffer to a file descriptor which may be a pipe.
+static int xbe_write(int fd, const void *buf, size_t size)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = write(fd, buf, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret < 0 ? -errno : -EIO;
+		buf = (const char *)buf + ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+//! Write zeros up to the end of a tar block.
+static int xbe_tar_pad(int fd, off_t size)
+{
+	static const char zeros[XBE_TAR_BLOCK];
+
+	if (!(size % XBE_TAR_BLOCK))
+		return 0;
+
+	return xbe_write(fd, zeros, XBE_TAR_BLOCK - size % XBE_TAR_BLOCK);
+}
+
+/*!
+ * \brief Append one record to pax extended header data.
+ *
+ * \return new length of \c data.
+ */
+static size_t xbe_pax_record(char *data, size_t length, const char *key,
+			     const char *value)
+{
+	size_t len = strlen(key) + strlen(value) + 3, total = len + 1;
+
+	// the length at the start of a record counts its own digits too
+	while (snprintf(NULL, 0, "%zu", total) + len != total)
+		total++;
+	sprintf(data + length, "%zu %s=%s\n", total, key, value);
+
+	return length + total;
+}
+
+//! Fill and write one tar header.
+static int xbe_tar_block(struct xbe *xbe, int fd, const char *name,
+			 size_t name_len, const char *prefix,
+			 size_t prefix_len, char type, off_t size)
+{
+	char block[XBE_TAR_BLOCK];
+	unsigned int sum = 0;
+	long long mtime;
+	int i;
+
+	memset(block, 0, sizeof(block));
+	memcpy(block, name, name_len);
+	snprintf(&block[100], 8, "%07o", type == '5' ? 0755 : 0644);
+	snprintf(&block[108], 8, "%07o", 0);
+	snprintf(&block[116], 8, "%07o", 0);
+	snprintf(&block[124], 12, "%011llo",
+		 (unsigned long long)(size > XBE_TAR_SIZE_MAX ? 0 : size));
+	mtime = (xbe->timestamp > 0) ? xbe->timestamp : 0;
+	snprintf(&block[136], 12, "%011llo", (unsigned long long)
+		 (mtime > XBE_TAR_SIZE_MAX ? XBE_TAR_SIZE_MAX : mtime));
+	memset(&block[148], ' ', 8);
+	block[156] = type;
+	memcpy(&block[257], "ustar", 6);
+	memcpy(&block[263], "00", 2);
+	memcpy(&block[345], prefix, prefix_len);
+
+	for (i = 0; i < XBE_TAR_BLOCK; i++)
+		sum += (unsigned char)block[i];
+	snprintf(&block[148], 8, "%06o", sum);
+
+	return xbe_write(fd, block, sizeof(block));
+}
+
+/*!
+ * \brief Write tar header of a file or directory.
+ *
+ * Names are split into the prefix and name fields of the ustar header
+ * where possible. Names which don't fit and sizes the header can't
+ * hold are stored in a pax extended header before it.
+ *
+ * \param path path inside of the archive, directories end with '/'.
+ * \return 0 on success, -errno otherwise.
+ */
+static int xbe_tar_header(struct xbe *xbe, int fd, const char *path,
+			  char type, off_t size)
+{
+	size_t len = strlen(path), split = 0, length = 0;
+	char *data, number[32];
+	int ret = 0;
+
+	if (len > 100) {
+		// the prefix ends at a slash, which isn't stored
+		for (split = (len - 1 < 155) ? len - 1 : 155; split > 0;
+		     split--)
+			if (path[split] == '/' && len - split - 1 <= 100 &&
+			    len - split - 1 > 0)
+				break;
+	}
+
+	if ((len > 100 && !split) || size > XBE_TAR_SIZE_MAX) {
+		data = (char *)malloc(len + 64);
+		if (!data)
+			return -ENOMEM;
+		if (len > 100 && !split)
+			length = xbe_pax_record(data, length, "path", path);
+		if (size > XBE_TAR_SIZE_MAX) {
+			snprintf(number, sizeof(number), "%lld",
+				 (long long)size);
+			length = xbe_pax_record(data, length, "size", number);
+		}
+		ret = xbe_tar_block(xbe, fd, "PaxHeader", 9, "", 0, 'x',
+				    length);
+		if (!ret)
+			ret = xbe_write(fd, data, length);
+		if (!ret)
+			ret = xbe_tar_pad(fd, length);
+		free(data);
+		if (ret)
+			return ret;
+	}
+
+	if (split)
+		return xbe_tar_block(xbe, fd, path + split + 1,
+				     len - split - 1, path, split, type, size);
+
+	// names in pax headers are cut short in the ustar header
+	return xbe_tar_block(xbe, fd, path, len > 100 ? 100 : len, "", 0,
+			     type, size);
+}
+
+//! Write data of a file to the archive.
+static int xbe_tar_data(struct xbe *xbe, int fd, struct tree *node,
+			char **buf)
+{
+	struct image_readahead ra;
+	off_t offset = node->offset, size = node->size, pos;
+	size_t want;
+	ssize_t ret;
+	int in;
+
+	// plain and trimmed images are passed to the kernel, which moves
+	// the data from the page cache to the file or pipe directly
+	in = image_splice_fd(xbe->image, offset, size, &pos);
+	while (in >= 0 && size > 0) {
+		ret = sendfile(fd, in, &pos, (size < XBE_SENDFILE_MAX) ?
+			       size : XBE_SENDFILE_MAX);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		offset += ret;
+		size -= ret;
+	}
+	if (!size)
+		return xbe_tar_pad(fd, node->size);
+
+	if (!*buf && !(*buf = (char *)malloc(IMAGE_COPY_SIZE)))
+		return -ENOMEM;
+
+	// large reads with read-ahead, which lets compressed images
+	// decompress the data following in parallel
+	image_readahead_init(&ra, offset, size);
+	ret = 0;
+	while (!ret && size > 0) {
+		want = (size < IMAGE_COPY_SIZE) ? size : IMAGE_COPY_SIZE;
+		image_readahead(xbe->image, &ra, offset, want);
+		ret = image_read(xbe->image, *buf, want, offset);
+		if (ret >= 0 && (size_t)ret < want)
+			ret = -EIO;
+		if (ret >= 0)
+			ret = xbe_write(fd, *buf, want);
+		offset += want;
+		size -= want;
+	}
+	image_readahead_destroy(&ra);
+
+	return ret ? ret : xbe_tar_pad(fd, node->size);
+}
+
+//! \c qsort() comparison function for files by offset.
+static int xbe_file_cmp(const void *a, const void *b)
+{
+	const struct xbe_file *x = (const struct xbe_file *)a;
+	const struct xbe_file *y = (const struct xbe_file *)b;
+
+	return (x->node->offset > y->node->offset) -
+		(x->node->offset < y->node->offset);
+}
+
+/*!
+ * \brief Write all directories and files as a tar archive.
+ *
+ * Paths of \c xbe have to be collected under an empty path, so that
+ * they start with a slash, which is dropped in the archive.
+ *
+ * \return 0 on success, -1 on failure.
+ */
+static int xbe_tar(struct xbe *xbe, int fd)
+{
+	static const char end[2 * XBE_TAR_BLOCK];
+	char *path, *buf = NULL;
+	const char *name = "";
+	int ret = 0, percent = -1, i;
+	off_t done = 0;
+
+	// directories first, so that every file follows its directory
+	for (i = 0; !ret && i < xbe->ndirs; i++) {
+		if (asprintf(&path, "%s/", xbe->dirs[i] + 1) < 0) {
+			ret = -ENOMEM;
+			break;
+		}
+		ret = xbe_tar_header(xbe, fd, path, '5', 0);
+		free(path);
+	}
+
+	qsort(xbe->files, xbe->nfiles, sizeof(struct xbe_file),
+	      xbe_file_cmp);
+	for (i = 0; i < xbe->nfiles; i++)
+		xbe->total += xbe->files[i].node->size;
+	for (i = 0; !ret && i < xbe->nfiles; i++) {
+		name = xbe->files[i].path;
+		ret = xbe_tar_header(xbe, fd, xbe->files[i].path + 1, '0',
+				     xbe->files[i].node->size);
+		if (!ret)
+			ret = xbe_tar_data(xbe, fd, xbe->files[i].node, &buf);
+
+		done += xbe->files[i].node->size;
+		if (!quiet && xbe->total && done * 100 / xbe->total != percent) {
+			percent = done * 100 / xbe->total;
+			fprintf(stderr, "\r%d%%", percent);
+		}
+	}
+	if (!quiet && percent >= 0)
+		fprintf(stderr, "\n");
+
+	if (!ret) {
+		name = "";
+		ret = xbe_write(fd, end, sizeof(end));
+	}
+	if (ret)
+		fprintf(stderr, "writing archive failed%s%s: %s\n",
+			*name ? " at " : "", *name ? name + 1 : "",
+			strerror(-ret));
+
+	free(buf);
+
+	return ret ? -1 : 0;
+}
+
+static void xbe_usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [<options>] <image_file> <directory>\n"
+		"       %s -c [<options>] <image_file> > <archive>\n\n",
+		name, name);
+	fprintf(stderr, "Available options:\n");
+	fprintf(stderr,
+		"\t-c - write a tar archive to standard output\n");
+	fprintf(stderr,
+		"\t-j N - copy with N threads (default: number of CPUs)\n");
+	fprintf(stderr,
+		"\t-q - quiet mode (print only error messages)\n");
+	exit(EXIT_FAILURE);
+}
+
+/*!
+ * \brief Main function.
+ */
+int main(int argc, char *argv[])
+{
+	struct xbfsfile *xbfs;
+	struct xbe xbe;
+	int progress = 1, archive = 0, nthreads, fd, c, ret, i;
+	const char *dest;
+
+	memset(&xbe, 0, sizeof(xbe));
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt(argc, argv, "cj:q")) != -1) {
+		switch (c) {
+		case 'c':
+			archive = 1;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1) {
+				fprintf(stderr, "invalid number of threads: %s\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'q':
+			progress = 0;
+			break;
+		default:
+			xbe_usage(argv[0]);
+		}
+	}
+	if (argc - optind != (archive ? 1 : 2))
+		xbe_usage(argv[0]);
+	if (nthreads < 1)
+		nthreads = 1;
+	dest = archive ? "" : argv[optind + 1];
+
+	if (archive && isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "refusing to write archive to a terminal\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	// the whole tree is needed, its tables are read in parallel too
+	xbfs_options.load_threads = nthreads;
+	xbfs = xbfs_load(fd, NULL, NULL);
+	if (!xbfs)
+		exit(EXIT_FAILURE);
+	quiet = !progress;
+
+	xbe.image = xbfs->image;
+	xbe.timestamp = xbfs->timestamp;
+	if (xbe_collect(&xbe, xbfs->tree, dest) ||
+	    (!archive && xbe_plan(&xbe))) {
+		fprintf(stderr, "not enough memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (archive) {
+		ret = xbe_tar(&xbe, STDOUT_FILENO);
+		goto done;
+	}
+
+	if (mkdir(dest, 0755) && errno != EEXIST) {
+		perror(dest);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < xbe.ndirs; i++)
+		if (mkdir(xbe.dirs[i], 0755) && errno != EEXIST) {
+			perror(xbe.dirs[i]);
+			exit(EXIT_FAILURE);
+		}
+
+	ret = xbe_run(&xbe, nthreads);
+
+done:
+	if (!quiet)
+		fprintf(stderr, "%d files, %d directories, %lld bytes\n",
+			xbe.nfiles, xbe.ndirs, (long long)xbe.total);
+
+	for (i = 0; i < xbe.nfiles; i++)
+		free(xbe.files[i].path);
+	for (i = 0; i < xbe.ndirs; i++)
+		free(xbe.dirs[i]);
+	free(xbe.files);
+	free(xbe.dirs);
+	free(xbe.chunks);
+	xbfs_unload(xbfs);
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
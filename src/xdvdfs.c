@@ -22,29 +22,69 @@
  * \brief Interpret the Xbox XDVD filesystem
  */
 
-#include <ctype.h>
-
 #include "tree.h"
 #include "xdvdfs.h"
 
+#include <ctype.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <time.h>
+
 // cast this constant as an unsigned long long in the hopes that the compiler will
 // always to the right 64-bit math
 #define SECTOR_SIZE 2048ULL
-#define NAME_MAX_SIZE 1024
+#define XBFS_MAX_DEPTH 256
+#define SCAN_CHUNK_SIZE (4 * 1024 * 1024)
+#define SCAN_REPORT_INTERVAL (256LL * 1024 * 1024)
 #define XDVD_SIGNATURE "MICROSOFT*XBOX*MEDIA"
 #define XDVD_SIGNATURE_SIZE 0x14
 #define WINDOWS_TICK 10000000
 #define SEC_TO_UNIX_EPOCH 11644473600LL
 
-// global file descriptor since main program needs to access it
+// global file descriptor since main program needs to access it,
+// -1 when a directory of images is mounted
 int xbfs_fd;
 
-static time_t timestamp;
+// absolute path of the image file or directory, set by the main program
+char *xbfs_path;
 
-//! Extract \c xbfsfile structure from FUSE context.
-static inline struct xbfsfile *get_xbfsfile_from_context(void)
+// options set by the main program
+struct xbfs_options xbfs_options;
+
+//! Extract \c xbfs_mount structure from FUSE context.
+static inline struct xbfs_mount *get_mount_from_context(void)
 {
-	return (struct xbfsfile *)fuse_get_context()->private_data;
+	return (struct xbfs_mount *)fuse_get_context()->private_data;
+}
+
+/*!
+ * \brief Find image a FUSE path belongs to.
+ *
+ * \param path path given by FUSE; the path inside of the image (at
+ * least "/") is stored back here. If the path is the top directory of
+ * a multi-image mount, NULL is stored.
+ * \return image or NULL if there is no such image (or \c path is the
+ * top directory).
+ */
+static struct xbfsfile *xbfs_resolve(const char **path)
+{
+	struct xbfs_mount *mount = get_mount_from_context();
+	struct xbfsfile *xbfs;
+	const char *name = *path + 1, *end;
+
+	if (!mount->multi)
+		return mount->images[0];
+
+	if (!*name) {
+		*path = NULL;
+		return NULL;
+	}
+
+	end = strchrnul(name, '/');
+	xbfs = xbfs_mount_find(mount, name, end - name);
+	*path = *end ? end : "/";
+
+	return xbfs;
 }
 
 // **********************************************************************
@@ -62,16 +102,73 @@ static inline struct xbfsfile *get_xbfsfile_from_context(void)
  */
 static int xbfs_getattr(const char *path, struct stat *stbuf)
 {
-	return tree_getattr(path, stbuf, get_xbfsfile_from_context()->tree,
-		get_xbfsfile_from_context()->fd);
+	struct xbfs_mount *mount = get_mount_from_context();
+	struct xbfsfile *xbfs = xbfs_resolve(&path);
+	int ret;
+
+	if (!xbfs) {
+		if (path)
+			return -ENOENT;
+		xbfs_mount_stat(mount, NULL, stbuf);
+		return 0;
+	}
+
+	// listing the top directory must not load every image
+	if (mount->multi && !strcmp(path, "/")) {
+		xbfs_mount_stat(mount, xbfs, stbuf);
+		return 0;
+	}
+
+	ret = xbfs_mount_use(mount, xbfs);
+	if (ret)
+		return ret;
+	ret = tree_getattr(path, stbuf, xbfs->tree, xbfs->index,
+			   xbfs->image->fd);
+	xbfs_mount_unuse(mount, xbfs);
+
+	return ret;
 }
 
 /*!
  * \brief File open operation.
+ *
+ * The image stays in use until the file is released.
  */
 static int xbfs_open(const char *path, struct fuse_file_info *fi)
 {
-	return tree_open(path, fi, get_xbfsfile_from_context()->tree);
+	struct xbfs_mount *mount = get_mount_from_context();
+	struct xbfsfile *xbfs = xbfs_resolve(&path);
+	int ret;
+
+	if (!xbfs)
+		return path ? -ENOENT : -EISDIR;
+
+	ret = xbfs_mount_use(mount, xbfs);
+	if (ret)
+		return ret;
+	ret = tree_open(path, fi, xbfs->tree, xbfs->index, xbfs->image);
+	if (ret)
+		xbfs_mount_unuse(mount, xbfs);
+
+	// file data never change, so pages cached by earlier opens stay
+	// valid
+	fi->keep_cache = xbfs_options.keep_cache;
+
+	return ret;
+}
+
+/*!
+ * \brief Release an open file.
+ */
+static int xbfs_release(const char *path, struct fuse_file_info *fi)
+{
+	struct xbfsfile *xbfs = xbfs_resolve(&path);
+
+	tree_release(path, fi);
+	if (xbfs)
+		xbfs_mount_unuse(get_mount_from_context(), xbfs);
+
+	return 0;
 }
 
 /*!
@@ -80,18 +177,71 @@ static int xbfs_open(const char *path, struct fuse_file_info *fi)
 static int xbfs_read(const char *path, char *buf, size_t size,
 		    off_t offset, struct fuse_file_info *fi)
 {
-	return tree_read(path, buf, size, offset, fi,
-		 get_xbfsfile_from_context()->tree,
-		 get_xbfsfile_from_context()->fd,
-		 &get_xbfsfile_from_context()->mutex);
+	struct xbfsfile *xbfs = xbfs_resolve(&path);
+
+	if (!xbfs)
+		return path ? -ENOENT : -EISDIR;
+
+	// the open file keeps the image loaded
+	return tree_read(path, buf, size, offset, fi, xbfs->tree, xbfs->index,
+			 xbfs->image);
+}
+
+#ifdef HAVE_FUSE_READ_BUF
+/*!
+ * \brief Read data from an open file without copying it.
+ */
+static int xbfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+			 size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct xbfsfile *xbfs = xbfs_resolve(&path);
+
+	if (!xbfs)
+		return path ? -ENOENT : -EISDIR;
+
+	return tree_read_buf(path, bufp, size, offset, fi, xbfs->tree,
+			     xbfs->index, xbfs->image);
 }
+#endif
 
 /*!
  * Open directory.
+ *
+ * The image stays in use until the directory is released, as the
+ * handle points to its tree.
  */
 static int xbfs_opendir(const char *path, struct fuse_file_info *fi)
 {
-	return tree_opendir(path, fi, get_xbfsfile_from_context()->tree);
+	struct xbfs_mount *mount = get_mount_from_context();
+	struct xbfsfile *xbfs = xbfs_resolve(&path);
+	int ret;
+
+	if (!xbfs) {
+		fi->fh = 0;
+		return path ? -ENOENT : 0;
+	}
+
+	ret = xbfs_mount_use(mount, xbfs);
+	if (ret)
+		return ret;
+	ret = tree_opendir(path, fi, xbfs->tree, xbfs->index);
+	if (ret)
+		xbfs_mount_unuse(mount, xbfs);
+
+	return ret;
+}
+
+/*!
+ * \brief Release directory.
+ */
+static int xbfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct xbfsfile *xbfs = xbfs_resolve(&path);
+
+	if (xbfs)
+		xbfs_mount_unuse(get_mount_from_context(), xbfs);
+
+	return 0;
 }
 
 /*!
@@ -101,30 +251,54 @@ static int xbfs_readdir(const char *path, void *buf,
 		       fuse_fill_dir_t filler, off_t offset,
 		       struct fuse_file_info *fi)
 {
-	return tree_readdir(path, buf, filler, offset, fi,
-			    get_xbfsfile_from_context()->tree);
+	struct xbfs_mount *mount = get_mount_from_context();
+	struct xbfsfile *xbfs = xbfs_resolve(&path);
+	int i;
+
+	if (!xbfs) {
+		if (path)
+			return -ENOENT;
+
+		// top directory of a multi-image mount, straight from the
+		// catalog
+		filler(buf, ".", NULL, 0);
+		filler(buf, "..", NULL, 0);
+		for (i = 0; i < mount->nimages; i++)
+			if (xbfs_mount_listed(mount->images[i]))
+				filler(buf, mount->images[i]->name, NULL, 0);
+		return 0;
+	}
+
+	return tree_readdir(path, buf, filler, offset, fi, xbfs->tree,
+			    xbfs->index);
 }
 
-// xbfs_recurse_file_subtree() calls this function
-static void xbfs_recurse_directory(
-	char *name_buffer,
-	int fd,
-	off_t filesystem_base_offset,
-	unsigned int dir_entry_sector,
-	unsigned int dir_entry_size,
-	struct tree *root);
+/*!
+ * \brief Files of one directory table, in the order of the table.
+ */
+struct xbfs_dir_list {
+	//! Collected files, names point into the directory table.
+	struct tree_entry *entries;
+	//! Number of \c entries.
+	int count;
+	//! Allocated size of \c entries.
+	int alloc;
+	//! One bit for every 4 bytes of the table, set for visited records.
+	unsigned char *visited;
+};
 
 /*!
  * \brief Recurse through a directory structure.
+ *
+ * This does an in-order traversal of the binary tree stored in the
+ * directory table, so files are collected sorted by name.
  */
 static void xbfs_recurse_file_subtree(
-	char *name_buffer,
-	int fd,
 	off_t filesystem_base_offset,
 	unsigned char *dir_entry,
 	unsigned int dir_entry_size,
 	int filerecord_offset,
-	struct tree *root)
+	struct xbfs_dir_list *list)
 {
 	unsigned int subtree_offset;
 	unsigned int file_sector;
@@ -132,19 +306,26 @@ static void xbfs_recurse_file_subtree(
 	unsigned char file_attributes;
 	unsigned char filename_size;
 	int is_dir;
-	int start_index;
-	char name_copy[NAME_MAX_SIZE];
+	struct tree_entry *entry;
 
 	// if there is not enough data left in the buffer for a minimal file record, get out
 	if (filerecord_offset + 0xD >= dir_entry_size)
 		return;
 
+	// a record seen before means the table loops, through either
+	// subtree
+	if (list->visited[filerecord_offset / 32] &
+	    (1 << (filerecord_offset / 4 % 8)))
+		return;
+	list->visited[filerecord_offset / 32] |=
+		1 << (filerecord_offset / 4 % 8);
+
 	// process left subtree
 	subtree_offset = LE_16(&dir_entry[filerecord_offset]) * 4;
 	if (subtree_offset)
-		xbfs_recurse_file_subtree(name_buffer, fd,
+		xbfs_recurse_file_subtree(
 			filesystem_base_offset, dir_entry, dir_entry_size, 
-			subtree_offset, root);
+			subtree_offset, list);
 
 	// process file
 	file_sector = LE_32(&dir_entry[filerecord_offset + 4]);
@@ -152,166 +333,1284 @@ static void xbfs_recurse_file_subtree(
 	file_attributes = dir_entry[filerecord_offset + 0xC];
 	is_dir = file_attributes & 0x10;
 	filename_size = dir_entry[filerecord_offset + 0xD];
-	strcpy(name_copy, name_buffer);
-	start_index = strlen(name_copy);
-	memcpy(&name_copy[start_index], &dir_entry[filerecord_offset + 0xE],
-		filename_size);
-	name_copy[start_index + filename_size] = '\0';
-
-	if (is_dir) {
-		name_copy[start_index + filename_size] = '/';
-		name_copy[start_index + filename_size + 1] = '\0';
-		xbfs_recurse_directory(name_copy, 
-			fd,
-			filesystem_base_offset,
-			file_sector,
-			file_size,
-			root);
-	} else {
-		fprintf(stderr, " inserting %s: sector 0x%X, 0x%X bytes, attribute byte = 0x%X, %s\n", 
-			name_copy, file_sector, file_size, file_attributes, 
-			is_dir ? "directory" : "");
+	if (filerecord_offset + 0xE + filename_size > dir_entry_size)
+		return;
 
-		tree_insert(root, name_copy, strlen(name_copy),
-			filesystem_base_offset + file_sector * SECTOR_SIZE,
-			file_size, timestamp);
+	if (list->count == list->alloc) {
+		int alloc = list->alloc ? list->alloc * 2 : 64;
+
+		entry = (struct tree_entry *)realloc(list->entries,
+			alloc * sizeof(struct tree_entry));
+		if (!entry)
+			return;
+		list->entries = entry;
+		list->alloc = alloc;
 	}
 
+	if (!is_dir && !quiet)
+		fprintf(stderr, " inserting %.*s: sector 0x%X, 0x%X bytes, attribute byte = 0x%X\n", 
+			filename_size,
+			(char *)&dir_entry[filerecord_offset + 0xE],
+			file_sector, file_size, file_attributes);
+
+	entry = &list->entries[list->count++];
+	entry->name = (char *)&dir_entry[filerecord_offset + 0xE];
+	entry->length = filename_size;
+	entry->is_dir = is_dir ? 1 : 0;
+	entry->offset = filesystem_base_offset + file_sector * SECTOR_SIZE;
+	entry->size = file_size;
+
 	// process right subtree
 	subtree_offset = LE_16(&dir_entry[filerecord_offset + 2]) * 4;
 	if (subtree_offset)
-		xbfs_recurse_file_subtree(name_buffer, fd,
+		xbfs_recurse_file_subtree(
 			filesystem_base_offset, dir_entry, dir_entry_size, 
-			subtree_offset, root);
+			subtree_offset, list);
 }
 
 /*!
- * \brief Recurse through a directory structure.
+ * \brief Load one directory table.
+ *
+ * Loads the directory table of \c dir (its offset and size are taken
+ * from the node) and sets contents of \c dir. This is the \c tree
+ * loader of XBFS directory trees.
  */
-static void xbfs_recurse_directory(
-	char *name_buffer,
-	int fd,
-	off_t filesystem_base_offset,
-	unsigned int dir_entry_sector,
-	unsigned int dir_entry_size,
-	struct tree *root)
+static int xbfs_load_directory(void *data, struct tree *root,
+			       struct tree *dir)
 {
+	struct xbfsfile *xbfs = (struct xbfsfile *)data;
 	unsigned char *dir_entry;
-	off_t current_offset = filesystem_base_offset;
+	unsigned int dir_entry_size = dir->size;
+	struct xbfs_dir_list list = { NULL, 0, 0, NULL };
+	int ret;
 
-	fprintf(stderr, "loading directory %s @ sector 0x%X, 0x%X bytes\n",
-		(name_buffer[0]) ? name_buffer : "(root)",
-		dir_entry_sector,
-		dir_entry_size);
+	if (!quiet)
+		fprintf(stderr, "loading directory %s @ sector 0x%llX, 0x%X bytes\n",
+			(dir->name[0]) ? dir->name : "(root)",
+			(unsigned long long)((dir->offset - xbfs->base_offset) / SECTOR_SIZE),
+			dir_entry_size);
 
-	// allocate a buffer and load the entire directory entry; round up to the
-	// nearest sector
+	// empty directories have no table at all
+	if (!dir_entry_size)
+		return tree_set_children(root, dir, NULL, 0, xbfs->timestamp);
+
+	// allocate a buffer and load the entire directory entry
 	dir_entry = (unsigned char *)malloc(dir_entry_size);
-	if (!dir_entry)
-		return;
+	list.visited = (unsigned char *)calloc(dir_entry_size / 32 + 1, 1);
+	if (!dir_entry || !list.visited) {
+		free(dir_entry);
+		free(list.visited);
+		return -ENOMEM;
+	}
 
-	current_offset += dir_entry_sector * SECTOR_SIZE;
-	lseek(fd, current_offset, SEEK_SET);
-	if (read(fd, dir_entry, dir_entry_size) != dir_entry_size) {
+	if (image_read(xbfs->image, dir_entry, dir_entry_size, dir->offset) != dir_entry_size) {
+		free(list.visited);
 		free(dir_entry);
-		return;
+		return -EIO;
 	}
 
-	xbfs_recurse_file_subtree(name_buffer, fd,
-		filesystem_base_offset, dir_entry, dir_entry_size, 
-		0, root);
+	xbfs_recurse_file_subtree(xbfs->base_offset, dir_entry,
+		dir_entry_size, 0, &list);
 
+	// names are copied into the tree, so the table can go now
+	ret = tree_set_children(root, dir, list.entries, list.count,
+				xbfs->timestamp);
+	free(list.entries);
+	free(list.visited);
 	free(dir_entry);
+
+	return ret;
 }
 
 /*!
- * \brief Initialize filesystem.
+ * \brief Offsets of the directory tables loaded so far.
+ *
+ * Tables referring to themselves or to their parents, even several
+ * times each, would make the tree grow without bounds, so every table
+ * is loaded only once per image.
+ */
+struct xbfs_table_set {
+	//! Open addressing hash table, -1 marks free slots.
+	off_t *slots;
+	//! Number of \c slots, a power of two.
+	size_t size;
+	//! Number of used \c slots.
+	size_t count;
+};
+
+// Slot of offset in the set, or of the free slot it would go to.
+static size_t xbfs_table_slot(struct xbfs_table_set *set, off_t offset)
+{
+	size_t slot = (size_t)(((uint64_t)offset * 0x9E3779B97F4A7C15ULL) >>
+			       32) & (set->size - 1);
+
+	while (set->slots[slot] != -1 && set->slots[slot] != offset)
+		slot = (slot + 1) & (set->size - 1);
+
+	return slot;
+}
+
+/*!
+ * \brief Claim the directory table of \c dir for loading.
+ *
+ * \return 1 if \c dir has to be skipped, because its table was
+ * claimed before (or there is no memory to remember it), 0 otherwise.
+ */
+static int xbfs_table_claim(struct xbfs_table_set *set, struct tree *dir)
+{
+	off_t *slots, *old = set->slots;
+	size_t i, size = set->size;
+
+	// empty directories have no table at all
+	if (!dir->size)
+		return 0;
+
+	if (2 * (set->count + 1) > set->size) {
+		set->size = size ? 2 * size : 64;
+		slots = (off_t *)malloc(set->size * sizeof(off_t));
+		if (!slots) {
+			set->size = size;
+			return 1;
+		}
+		memset(slots, 0xff, set->size * sizeof(off_t));
+		set->slots = slots;
+		for (i = 0; i < size; i++)
+			if (old[i] != -1)
+				slots[xbfs_table_slot(set, old[i])] = old[i];
+		free(old);
+	}
+
+	i = xbfs_table_slot(set, dir->offset);
+	if (set->slots[i] != -1)
+		return 1;
+	set->slots[i] = dir->offset;
+	set->count++;
+
+	return 0;
+}
+
+/*!
+ * \brief Leave out a directory whose table was loaded elsewhere.
+ *
+ * It is set empty, so that nothing loads it later either.
  */
-static void *xbfs_init(void)
+static void xbfs_skip_directory(struct xbfsfile *xbfs, struct tree *dir)
+{
+	if (!quiet)
+		fprintf(stderr, "skipping directory %s, its table is used twice\n",
+			dir->name);
+	tree_set_children(xbfs->tree, dir, NULL, 0, xbfs->timestamp);
+}
+
+/*!
+ * \brief Recurse through a directory structure.
+ *
+ * Loads \c dir and all directories below it whose tables aren't in
+ * \c tables yet.
+ */
+static void xbfs_recurse_directory(struct xbfsfile *xbfs, struct tree *dir,
+				   int depth, struct xbfs_table_set *tables)
+{
+	int i;
+
+	// a backstop only, tables loop no deeper than they are loaded
+	if (depth > XBFS_MAX_DEPTH)
+		return;
+
+	if (tree_load(xbfs->tree, dir))
+		return;
+
+	for (i = 0; i < dir->nsub; i++) {
+		if (!dir->sub[i].is_dir)
+			continue;
+		if (xbfs_table_claim(tables, &dir->sub[i]))
+			xbfs_skip_directory(xbfs, &dir->sub[i]);
+		else
+			xbfs_recurse_directory(xbfs, &dir->sub[i], depth + 1,
+					       tables);
+	}
+}
+
+/*!
+ * \brief Directory waiting in the \c xbfs_load_queue.
+ */
+struct xbfs_load_item {
+	//! Directory to be loaded.
+	struct tree *dir;
+	//! Depth of \c dir in the hierarchy.
+	int depth;
+};
+
+/*!
+ * \brief Queue of directories shared by the tree loading threads.
+ */
+struct xbfs_load_queue {
+	//! Image being loaded.
+	struct xbfsfile *xbfs;
+	//! Tables queued so far.
+	struct xbfs_table_set *tables;
+	//! Directories not taken by any thread yet (used as a stack).
+	struct xbfs_load_item *items;
+	//! Number of \c items.
+	int count;
+	//! Allocated size of \c items.
+	int alloc;
+	//! Number of directories being loaded right now.
+	int busy;
+	//! Protects everything above.
+	pthread_mutex_t lock;
+	//! Signalled when \c items grow or when all work is done.
+	pthread_cond_t cond;
+};
+
+/*!
+ * \brief Tree loading thread.
+ *
+ * Takes directories from the queue, loads their tables and queues
+ * their subdirectories, until the queue is empty and no other thread
+ * can add anything more.
+ */
+static void *xbfs_load_thread(void *data)
+{
+	struct xbfs_load_queue *queue = (struct xbfs_load_queue *)data;
+	struct xbfs_load_item item, *items;
+	int i, n;
+
+	pthread_mutex_lock(&queue->lock);
+	for (;;) {
+		while (!queue->count && queue->busy)
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		if (!queue->count)
+			break;
+
+		item = queue->items[--queue->count];
+		queue->busy++;
+		pthread_mutex_unlock(&queue->lock);
+
+		// every directory is queued exactly once, so nobody else
+		// can be setting its contents; a failed one is left for
+		// tree_load() to retry on first use
+		xbfs_load_directory(queue->xbfs, queue->xbfs->tree, item.dir);
+
+		pthread_mutex_lock(&queue->lock);
+		// the depth is a backstop only, see xbfs_table_claim()
+		n = (item.depth < XBFS_MAX_DEPTH && item.dir->loaded) ?
+			item.dir->nsubdirs : 0;
+		if (queue->count + n > queue->alloc) {
+			int alloc = queue->alloc * 2;
+
+			while (alloc < queue->count + n)
+				alloc *= 2;
+			items = (struct xbfs_load_item *)realloc(queue->items,
+				alloc * sizeof(struct xbfs_load_item));
+			if (items) {
+				queue->items = items;
+				queue->alloc = alloc;
+			} else
+				n = 0;
+		}
+		for (i = 0; n && i < item.dir->nsub; i++)
+			if (item.dir->sub[i].is_dir &&
+			    xbfs_table_claim(queue->tables, &item.dir->sub[i]))
+				xbfs_skip_directory(queue->xbfs,
+						    &item.dir->sub[i]);
+			else if (item.dir->sub[i].is_dir) {
+				queue->items[queue->count].dir = &item.dir->sub[i];
+				queue->items[queue->count].depth = item.depth + 1;
+				queue->count++;
+			}
+		queue->busy--;
+		pthread_cond_broadcast(&queue->cond);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return NULL;
+}
+
+/*!
+ * \brief Load the whole directory hierarchy using many threads.
+ *
+ * Directory tables are independent of each other once their extents
+ * are known, so with \c nthreads threads that many tables are being
+ * read at once. This hides the latency of network filesystems and
+ * lets disks reorder the requests.
+ */
+static void xbfs_load_parallel(struct xbfsfile *xbfs, int nthreads,
+			       struct xbfs_table_set *tables)
+{
+	struct xbfs_load_queue queue;
+	pthread_t *threads;
+	int i, started;
+
+	memset(&queue, 0, sizeof(queue));
+	queue.xbfs = xbfs;
+	queue.tables = tables;
+	queue.alloc = 64;
+	queue.items = (struct xbfs_load_item *)malloc(
+		queue.alloc * sizeof(struct xbfs_load_item));
+	threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+	if (!queue.items || !threads) {
+		free(queue.items);
+		free(threads);
+		xbfs_recurse_directory(xbfs, xbfs->tree, 0, tables);
+		return;
+	}
+	queue.items[0].dir = xbfs->tree;
+	queue.items[0].depth = 0;
+	queue.count = 1;
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.cond, NULL);
+
+	for (started = 0; started < nthreads; started++)
+		if (pthread_create(&threads[started], NULL, xbfs_load_thread,
+				   &queue))
+			break;
+	// if no thread could be started, do the work here
+	if (!started)
+		xbfs_load_thread(&queue);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&queue.cond);
+	pthread_mutex_destroy(&queue.lock);
+	free(queue.items);
+	free(threads);
+}
+
+/*!
+ * \brief Offsets of the game partition in known disc image layouts.
+ *
+ * The volume descriptor is 32 sectors past these offsets.
+ */
+static const off_t xbfs_partition_offsets[] = {
+	0,		// plain XISO (game partition only)
+	0x18300000,	// XGD1 (original Xbox) full disc image
+	0x0FD90000,	// XGD2 (Xbox 360) full disc image
+	0x02080000,	// XGD3 (Xbox 360) full disc image
+	-1
+};
+
+//! Check whether given sector is an XDVDFS volume descriptor.
+static inline int xbfs_is_volume_descriptor(unsigned char *sector_buffer)
+{
+	return !memcmp(sector_buffer, XDVD_SIGNATURE, XDVD_SIGNATURE_SIZE);
+}
+
+/*!
+ * \brief Scan the image for the XDVDFS volume descriptor.
+ *
+ * The image is read in large chunks and only the first 8 bytes of
+ * every sector are compared as one word, so this runs at disk
+ * bandwidth rather than at the rate of read calls.
+ *
+ * \param image disc image.
+ * \param sector_buffer the volume descriptor is stored here.
+ * \return offset of the filesystem inside of the image, -EINVAL if the
+ * signature is not found or another -errno on failure.
+ */
+static off_t xbfs_scan_volume(struct image *image,
+			      unsigned char *sector_buffer)
+{
+	unsigned char *chunk;
+	uint64_t signature, word;
+	off_t offset, next_report = SCAN_REPORT_INTERVAL;
+	ssize_t size, i;
+
+	chunk = (unsigned char *)malloc(SCAN_CHUNK_SIZE);
+	if (!chunk)
+		return -ENOMEM;
+
+	memcpy(&signature, XDVD_SIGNATURE, sizeof(signature));
+
+	for (offset = 0; ; offset += size) {
+		size = image_read(image, chunk, SCAN_CHUNK_SIZE, offset);
+		if (size < 0) {
+			free(chunk);
+			return size;
+		}
+		// only whole sectors can hold the descriptor
+		size -= size % SECTOR_SIZE;
+		if (size <= 0)
+			break;
+
+		for (i = 0; i < size; i += SECTOR_SIZE) {
+			memcpy(&word, &chunk[i], sizeof(word));
+			if (word != signature ||
+			    !xbfs_is_volume_descriptor(&chunk[i]))
+				continue;
+			// the filesystem would start before the image
+			if (offset + i < 32 * SECTOR_SIZE)
+				continue;
+
+			memcpy(sector_buffer, &chunk[i], SECTOR_SIZE);
+			free(chunk);
+			// the actual root of the filesystem is 32
+			// sectors back
+			return offset + i - 32 * SECTOR_SIZE;
+		}
+
+		if (!quiet && offset + size >= next_report) {
+			fprintf(stderr, "scanning for XDVD signature: %lld of %lld MiB\n",
+				(long long)((offset + size) >> 20),
+				(long long)(image->size >> 20));
+			next_report += SCAN_REPORT_INTERVAL;
+		}
+	}
+
+	free(chunk);
+
+	return -EINVAL;
+}
+
+/*!
+ * \brief Find the XDVDFS volume descriptor in the image.
+ *
+ * Known partition offsets are probed first, so usually this takes a
+ * single read. Otherwise the whole image is scanned.
+ *
+ * \param image disc image.
+ * \param sector_buffer the volume descriptor is stored here.
+ * \return offset of the filesystem inside of the image, -EINVAL if the
+ * signature is not found or another -errno on failure.
+ */
+static off_t xbfs_find_volume(struct image *image,
+			      unsigned char *sector_buffer)
+{
+	off_t offset;
+	int i;
+
+	for (i = 0; xbfs_partition_offsets[i] >= 0; i++) {
+		offset = xbfs_partition_offsets[i];
+		if (offset + 33 * SECTOR_SIZE > image->size)
+			continue;
+		if (image_read(image, sector_buffer, SECTOR_SIZE,
+			       offset + 32 * SECTOR_SIZE) == SECTOR_SIZE &&
+		    xbfs_is_volume_descriptor(sector_buffer))
+			return offset;
+	}
+
+	return xbfs_scan_volume(image, sector_buffer);
+}
+
+/*!
+ * \brief Key identifying an image in the tree cache.
+ */
+struct xbfs_cache_key {
+	//! Hash of the canonical path of the image.
+	uint64_t path_hash;
+	//! Size of the image file.
+	int64_t size;
+	//! Modification time of the image file.
+	int64_t mtime;
+	//! Nanoseconds of the modification time.
+	int64_t mtime_nsec;
+	//! Device of the image file.
+	uint64_t dev;
+	//! Inode of the image file.
+	uint64_t ino;
+};
+
+/*!
+ * \brief Get name of the tree cache file of an image.
+ *
+ * \param path path of the image file.
+ * \param fd file descriptor of the image file.
+ * \param key key identifying the image is stored here.
+ * \return allocated name or NULL on failure.
+ */
+static char *xbfs_cache_name(const char *path, int fd,
+			     struct xbfs_cache_key *key)
+{
+	char *real, *name;
+	const char *c;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+	real = realpath(path, NULL);
+	if (!real)
+		return NULL;
+
+	memset(key, 0, sizeof(*key));
+	// FNV-1a
+	key->path_hash = 14695981039346656037ULL;
+	for (c = real; *c; c++) {
+		key->path_hash ^= (unsigned char)*c;
+		key->path_hash *= 1099511628211ULL;
+	}
+	free(real);
+	key->size = st.st_size;
+	key->mtime = st.st_mtim.tv_sec;
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+	key->dev = st.st_dev;
+	key->ino = st.st_ino;
+
+	if (asprintf(&name, "%s/%016llx.tree", xbfs_options.index_cache,
+		     (unsigned long long)key->path_hash) < 0)
+		return NULL;
+
+	return name;
+}
+
+/*!
+ * \brief Load directory tree from the tree cache.
+ *
+ * \return tree root or NULL if there is no valid cache file.
+ */
+static struct tree *xbfs_cache_load(const char *name,
+				    struct xbfs_cache_key *key)
+{
+	struct tree *tree;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	tree = tree_restore(fd, key, sizeof(*key));
+	close(fd);
+
+	if (tree && !quiet)
+		fprintf(stderr, "using cached directory tree %s\n", name);
+
+	return tree;
+}
+
+/*!
+ * \brief Store complete directory tree in the tree cache.
+ *
+ * The file is written under a temporary name and renamed, so that
+ * concurrent mounts never see a partial file.
+ */
+static void xbfs_cache_save(const char *name, struct xbfs_cache_key *key,
+			    struct tree *tree)
+{
+	char *temp;
+	int fd;
+
+	if (asprintf(&temp, "%s.XXXXXX", name) < 0)
+		return;
+
+	fd = mkstemp(temp);
+	if (fd < 0) {
+		perror(temp);
+		free(temp);
+		return;
+	}
+
+	if (tree_save(tree, fd, key, sizeof(*key)) || fchmod(fd, 0644) ||
+	    close(fd) || rename(temp, name)) {
+		fprintf(stderr, "cannot write tree cache %s\n", name);
+		unlink(temp);
+	}
+
+	free(temp);
+}
+
+/*!
+ * \brief Open image and build its directory tree.
+ *
+ * This fills the image part of \c xbfs, see \c xbfs_load().
+ *
+ * \return 0 on success, -errno on failure; -EINVAL or -ENOTSUP mean
+ * that the file is not an image that can be read.
+ */
+static int xbfs_open_image(struct xbfsfile *xbfs, int fd, const char *path,
+			   struct block_cache *cache)
 {
-	char name_buffer[NAME_MAX_SIZE];
 	unsigned int root_directory_sector;
 	unsigned int root_directory_size;
 	unsigned char sector_buffer[SECTOR_SIZE];
-	off_t filesystem_base_offset = 0;
+	off_t filesystem_base_offset;
+	struct xbfs_cache_key cache_key;
+	struct xbfs_table_set tables = { NULL, 0, 0 };
+	char *cache_name = NULL;
+	int ret;
+
+	xbfs->image = image_open(fd, xbfs_options.backend);
+	if (!xbfs->image) {
+		ret = -errno;
+		perror("opening image");
+		return ret;
+	}
+	if (!quiet)
+		fprintf(stderr, "using %s image backend\n",
+			xbfs->image->backend->name);
+
+	if (cache)
+		image_set_cache(xbfs->image, cache);
+
+	if (xbfs_options.index_cache && path)
+		cache_name = xbfs_cache_name(path, fd, &cache_key);
+	if (cache_name && (xbfs->tree = xbfs_cache_load(cache_name,
+							&cache_key))) {
+		// the cache holds the complete tree, the image itself
+		// doesn't need to be parsed at all
+		free(cache_name);
+		xbfs->base_offset = 0;
+		tree_set_loader(xbfs->tree, xbfs_load_directory, xbfs);
+		xbfs->index = tree_index_build(xbfs->tree);
+		return 0;
+	}
+
+	filesystem_base_offset = xbfs_find_volume(xbfs->image, sector_buffer);
+	if (filesystem_base_offset < 0) {
+		if (filesystem_base_offset == -EINVAL)
+			fprintf(stderr, "XDVD signature (%s) not found\n", XDVD_SIGNATURE);
+		else
+			fprintf(stderr, "looking for XDVD signature: %s\n",
+				strerror(-filesystem_base_offset));
+		image_close(xbfs->image);
+		xbfs->image = NULL;
+		free(cache_name);
+		return filesystem_base_offset;
+	}
+
+	// process the volume descriptor
+	root_directory_sector = LE_32(&sector_buffer[0x14]);
+	root_directory_size = LE_32(&sector_buffer[0x18]);
+
+	// convert 64-bit Windows FILETIME structure to
+	// Unix epoch timestamp
+	xbfs->timestamp  = sector_buffer[0x1C+7];
+	xbfs->timestamp <<= 8;
+	xbfs->timestamp |= sector_buffer[0x1C+6];
+	xbfs->timestamp <<= 8;
+	xbfs->timestamp |= sector_buffer[0x1C+5];
+	xbfs->timestamp <<= 8;
+	xbfs->timestamp |= sector_buffer[0x1C+4];
+	xbfs->timestamp <<= 8;
+	xbfs->timestamp |= sector_buffer[0x1C+3];
+	xbfs->timestamp <<= 8;
+	xbfs->timestamp |= sector_buffer[0x1C+2];
+	xbfs->timestamp <<= 8;
+	xbfs->timestamp |= sector_buffer[0x1C+1];
+	xbfs->timestamp <<= 8;
+	xbfs->timestamp |= sector_buffer[0x1C+0];
+	xbfs->timestamp = xbfs->timestamp / WINDOWS_TICK - SEC_TO_UNIX_EPOCH;
+	if (!quiet)
+		fprintf(stderr, "UNIX timestamp: %ld\n", (long)xbfs->timestamp);
+
+	xbfs->tree = tree_empty();
+	if (!xbfs->tree) {
+		fprintf(stderr,"not enough memory\n");
+		image_close(xbfs->image);
+		xbfs->image = NULL;
+		free(cache_name);
+		return -ENOMEM;
+	}
+
+	xbfs->base_offset = filesystem_base_offset;
+	xbfs->index = NULL;
+	xbfs->tree->offset = filesystem_base_offset +
+		root_directory_sector * SECTOR_SIZE;
+	xbfs->tree->size = root_directory_size;
+	tree_set_loader(xbfs->tree, xbfs_load_directory, xbfs);
+
+	if (xbfs_options.lazy) {
+		// only the root directory now, the rest on first use
+		if (tree_load(xbfs->tree, xbfs->tree))
+			fprintf(stderr, "cannot load root directory\n");
+		free(cache_name);
+		return 0;
+	}
+
+	// build the tree
+	xbfs_table_claim(&tables, xbfs->tree);
+	if (xbfs_options.load_threads > 1)
+		xbfs_load_parallel(xbfs, xbfs_options.load_threads, &tables);
+	else
+		xbfs_recurse_directory(xbfs, xbfs->tree, 0, &tables);
+	free(tables.slots);
+
+	if (cache_name) {
+		xbfs_cache_save(cache_name, &cache_key, xbfs->tree);
+		free(cache_name);
+	}
+
+	// the tree is complete now, index it for fast path lookups
+	xbfs->index = tree_index_build(xbfs->tree);
+	if (!xbfs->index)
+		fprintf(stderr, "not enough memory for path index\n");
+
+	return 0;
+}
+
+/*!
+ * \brief Close image and free its directory tree, keeping the rest of
+ * \c xbfs.
+ */
+static void xbfs_close_image(struct xbfsfile *xbfs)
+{
+	if (xbfs->image) {
+		image_close(xbfs->image);
+		tree_index_free(xbfs->index);
+		tree_free(xbfs->tree);
+		xbfs->image = NULL;
+		xbfs->index = NULL;
+		xbfs->tree = NULL;
+		xbfs->memory = 0;
+	}
+}
+
+//! Allocate \c xbfsfile structure without an image.
+static struct xbfsfile *xbfs_new(void)
+{
+	struct xbfsfile *xbfs;
+
+	xbfs = (struct xbfsfile *)calloc(1, sizeof(struct xbfsfile));
+	if (xbfs)
+		pthread_mutex_init(&xbfs->lock, NULL);
+
+	return xbfs;
+}
+
+//! Free \c xbfsfile structure.
+static void xbfs_free(struct xbfsfile *xbfs)
+{
+	xbfs_close_image(xbfs);
+	pthread_mutex_destroy(&xbfs->lock);
+	free(xbfs->name);
+	free(xbfs->path);
+	free(xbfs);
+}
+
+struct xbfsfile *xbfs_load(int fd, const char *path,
+			   struct block_cache *cache)
+{
+	struct xbfsfile *xbfs = xbfs_new();
 
-	struct xbfsfile *xbfs = (struct xbfsfile *)malloc(sizeof(struct xbfsfile));
 	if (!xbfs) {
 		fprintf(stderr,"not enough memory\n");
-		close(xbfs_fd);
-		fuse_exit(fuse_get_context()->fuse);
+		close(fd);
 		return NULL;
 	}
 
-	xbfs->fd = xbfs_fd;
+	if (xbfs_open_image(xbfs, fd, path, cache)) {
+		xbfs_free(xbfs);
+		return NULL;
+	}
 
-	// scan sectors until the signature is found
-	lseek(xbfs->fd, filesystem_base_offset, SEEK_SET);
-	while (1) {
-		if (read(xbfs->fd, sector_buffer, SECTOR_SIZE) != SECTOR_SIZE) {
-			fprintf(stderr, "XDVD signature (%s) not found\n", XDVD_SIGNATURE);
-			close(xbfs->fd);
-			free(xbfs);
-			fuse_exit(fuse_get_context()->fuse);
-			return NULL;
+	return xbfs;
+}
+
+void xbfs_unload(struct xbfsfile *xbfs)
+{
+	if (xbfs)
+		xbfs_free(xbfs);
+}
+
+//! \c qsort() comparison function for images of a mount.
+static int xbfs_mount_cmp(const void *a, const void *b)
+{
+	return strcmp((*(struct xbfsfile * const *)a)->name,
+		      (*(struct xbfsfile * const *)b)->name);
+}
+
+/*!
+ * \brief Check quickly whether a file looks like an image.
+ *
+ * Only the header of container formats and the volume descriptor at
+ * the known partition offsets are read, not any directory table.
+ *
+ * \param fd file descriptor of the file.
+ * \param size size of the file.
+ * \return nonzero if the file looks like an image.
+ */
+static int xbfs_is_image(int fd, off_t size)
+{
+	unsigned char signature[XDVD_SIGNATURE_SIZE];
+	off_t offset;
+	int i;
+
+	if (image_probe(fd))
+		return 1;
+
+	for (i = 0; xbfs_partition_offsets[i] >= 0; i++) {
+		offset = xbfs_partition_offsets[i];
+		if (offset + 33 * SECTOR_SIZE > size)
+			continue;
+		if (image_pread(fd, signature, sizeof(signature),
+				offset + 32 * SECTOR_SIZE) ==
+		    sizeof(signature) && xbfs_is_volume_descriptor(signature))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Build the catalog of images in a directory.
+ *
+ * Every regular file, except for hidden ones, which is in a container
+ * format or has a volume descriptor at a known partition offset
+ * becomes an image (see \c xbfs_is_image()). Trees are not loaded until
+ * the images are used.
+ */
+static int xbfs_mount_scan(struct xbfs_mount *mount, const char *path)
+{
+	struct xbfsfile *xbfs, **images;
+	struct dirent *entry;
+	struct stat st;
+	int alloc = 0, fd, ok;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir) {
+		perror(path);
+		return -1;
+	}
+
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		if (fstatat(dirfd(dir), entry->d_name, &st, 0) < 0 ||
+		    !S_ISREG(st.st_mode))
+			continue;
+
+		fd = openat(dirfd(dir), entry->d_name, O_RDONLY);
+		ok = fd >= 0 && xbfs_is_image(fd, st.st_size);
+		if (fd >= 0)
+			close(fd);
+		if (!ok) {
+			if (!quiet)
+				fprintf(stderr, "skipping %s, not an image\n",
+					entry->d_name);
+			continue;
 		}
-		if (!strncmp((char *)sector_buffer, XDVD_SIGNATURE, XDVD_SIGNATURE_SIZE)) {
-			// the actual root of the filesystem is 32 sectors back
-			filesystem_base_offset -= (32 * SECTOR_SIZE);
-
-			// process the volume descriptor
-			root_directory_sector = LE_32(&sector_buffer[0x14]);
-			root_directory_size = LE_32(&sector_buffer[0x18]);
-
-			// convert 64-bit Windows FILETIME structure to
-			// Unix epoch timestamp
-			timestamp  = sector_buffer[0x1C+7];
-			timestamp <<= 8;
-			timestamp |= sector_buffer[0x1C+6];
-			timestamp <<= 8;
-			timestamp |= sector_buffer[0x1C+5];
-			timestamp <<= 8;
-			timestamp |= sector_buffer[0x1C+4];
-			timestamp <<= 8;
-			timestamp |= sector_buffer[0x1C+3];
-			timestamp <<= 8;
-			timestamp |= sector_buffer[0x1C+2];
-			timestamp <<= 8;
-			timestamp |= sector_buffer[0x1C+1];
-			timestamp <<= 8;
-			timestamp |= sector_buffer[0x1C+0];
-			timestamp = timestamp / WINDOWS_TICK - SEC_TO_UNIX_EPOCH;
-			fprintf(stderr, "UNIX timestamp: %ld\n", timestamp);
+
+		xbfs = xbfs_new();
+		if (xbfs) {
+			xbfs->name = strdup(entry->d_name);
+			xbfs->mtime = st.st_mtime;
+			if (asprintf(&xbfs->path, "%s/%s", path,
+				     entry->d_name) < 0)
+				xbfs->path = NULL;
+		}
+		if (mount->nimages == alloc) {
+			images = (struct xbfsfile **)realloc(mount->images,
+				(alloc ? alloc * 2 : 64) *
+				sizeof(struct xbfsfile *));
+			if (images) {
+				mount->images = images;
+				alloc = alloc ? alloc * 2 : 64;
+			}
+		}
+		if (!xbfs || !xbfs->name || !xbfs->path ||
+		    mount->nimages == alloc) {
+			fprintf(stderr, "not enough memory\n");
+			if (xbfs)
+				xbfs_free(xbfs);
 			break;
 		}
-		filesystem_base_offset += SECTOR_SIZE;
+		mount->images[mount->nimages++] = xbfs;
 	}
+	closedir(dir);
 
-	pthread_mutex_init(&xbfs->mutex, NULL);
+	qsort(mount->images, mount->nimages, sizeof(struct xbfsfile *),
+	      xbfs_mount_cmp);
+	if (!quiet)
+		fprintf(stderr, "%d images found in %s\n", mount->nimages,
+			path);
 
-	xbfs->tree = tree_empty();
+	return 0;
+}
+
+//! Get monotonic time in seconds.
+static time_t xbfs_now(void)
+{
+	struct timespec ts;
 
-	name_buffer[0] = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	// build the tree
-	xbfs_recurse_directory(name_buffer, xbfs->fd, filesystem_base_offset,
-		root_directory_sector, root_directory_size, xbfs->tree);
+	return ts.tv_sec;
+}
+
+//! Get memory used by tree, index and image backend of a loaded image.
+static size_t xbfs_memory(struct xbfsfile *xbfs)
+{
+	size_t size = tree_memory(xbfs->tree) + image_memory(xbfs->image);
+
+	if (xbfs->index)
+		size += xbfs->index->nslots * sizeof(struct tree_index_slot) +
+			xbfs->index->paths_size;
+
+	return size;
+}
+
+//! Check if an image may be evicted, its lock must be held.
+static inline int xbfs_evictable(struct xbfsfile *xbfs)
+{
+	return xbfs->image && !xbfs->users && !xbfs->nlookup;
+}
+
+//! \c qsort() comparison function ordering images by last use.
+static int xbfs_lru_cmp(const void *a, const void *b)
+{
+	time_t ta = (*(struct xbfsfile * const *)a)->last_used;
+	time_t tb = (*(struct xbfsfile * const *)b)->last_used;
 
-	return (void *)xbfs;
+	return (ta > tb) - (ta < tb);
 }
 
 /*!
- * \brief Clean up filesystem.
+ * \brief One pass of the reaper.
+ *
+ * Images idle for too long are evicted first. If the remaining trees
+ * still need more memory than allowed, the least recently used images
+ * which may be evicted go next.
  */
-static void xbfs_destroy(void *context)
+static void xbfs_reap(struct xbfs_mount *mount)
+{
+	struct xbfsfile *xbfs, **lru = NULL;
+	size_t total = 0;
+	time_t now = xbfs_now();
+	int i, idle, nlru = 0;
+
+	if (xbfs_options.memory_bytes)
+		lru = (struct xbfsfile **)malloc(mount->nimages *
+						 sizeof(struct xbfsfile *));
+
+	for (i = 0; i < mount->nimages; i++) {
+		xbfs = mount->images[i];
+		pthread_mutex_lock(&xbfs->lock);
+		idle = xbfs->image && !xbfs->users &&
+			xbfs_options.idle_timeout &&
+			now - xbfs->last_used >= xbfs_options.idle_timeout;
+		if (idle && !xbfs->nlookup) {
+			if (!quiet)
+				fprintf(stderr, "closing idle image %s\n",
+					xbfs->name);
+			xbfs_close_image(xbfs);
+			idle = 0;
+		} else if (xbfs->image) {
+			// lazily loaded trees keep growing
+			xbfs->memory = xbfs_memory(xbfs);
+			total += xbfs->memory;
+			if (lru && xbfs_evictable(xbfs))
+				lru[nlru++] = xbfs;
+		}
+		pthread_mutex_unlock(&xbfs->lock);
+
+		// the kernel may let go of the inodes
+		if (idle && mount->idle)
+			mount->idle(mount, xbfs);
+	}
+
+	if (!lru)
+		return;
+
+	qsort(lru, nlru, sizeof(struct xbfsfile *), xbfs_lru_cmp);
+	for (i = 0; i < nlru && total > xbfs_options.memory_bytes; i++) {
+		xbfs = lru[i];
+		pthread_mutex_lock(&xbfs->lock);
+		// it may have been used meanwhile
+		if (xbfs_evictable(xbfs)) {
+			if (!quiet)
+				fprintf(stderr, "closing image %s (memory "
+					"limit)\n", xbfs->name);
+			total -= xbfs->memory;
+			xbfs_close_image(xbfs);
+		}
+		pthread_mutex_unlock(&xbfs->lock);
+	}
+	free(lru);
+}
+
+/*!
+ * \brief Reaper thread of a multi-image mount.
+ */
+static void *xbfs_reaper(void *data)
+{
+	struct xbfs_mount *mount = (struct xbfs_mount *)data;
+	struct timespec deadline;
+	int interval = 10;
+
+	// check a few times per timeout, so images don't stay open much
+	// longer than asked for
+	if (xbfs_options.idle_timeout)
+		interval = xbfs_options.idle_timeout / 4;
+	if (interval < 1)
+		interval = 1;
+	if (interval > 60)
+		interval = 60;
+
+	pthread_mutex_lock(&mount->reaper_lock);
+	while (mount->reaping) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += interval;
+		pthread_cond_timedwait(&mount->reaper_cond,
+				       &mount->reaper_lock, &deadline);
+		if (!mount->reaping)
+			break;
+		pthread_mutex_unlock(&mount->reaper_lock);
+		xbfs_reap(mount);
+		pthread_mutex_lock(&mount->reaper_lock);
+	}
+	pthread_mutex_unlock(&mount->reaper_lock);
+
+	return NULL;
+}
+
+int xbfs_mount_start(struct xbfs_mount *mount)
+{
+	pthread_condattr_t attr;
+
+	if (!mount->multi ||
+	    (!xbfs_options.idle_timeout && !xbfs_options.memory_bytes))
+		return 0;
+
+	// the deadlines are monotonic, like last_used
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&mount->reaper_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&mount->reaper_lock, NULL);
+
+	mount->reaping = 1;
+	if (pthread_create(&mount->reaper, NULL, xbfs_reaper, mount)) {
+		fprintf(stderr, "cannot start image reaper\n");
+		mount->reaping = 0;
+		pthread_cond_destroy(&mount->reaper_cond);
+		pthread_mutex_destroy(&mount->reaper_lock);
+		return -1;
+	}
+
+	return 0;
+}
+
+void xbfs_mount_stop(struct xbfs_mount *mount)
+{
+	if (!mount->reaping)
+		return;
+
+	pthread_mutex_lock(&mount->reaper_lock);
+	mount->reaping = 0;
+	pthread_cond_signal(&mount->reaper_cond);
+	pthread_mutex_unlock(&mount->reaper_lock);
+	pthread_join(mount->reaper, NULL);
+
+	pthread_cond_destroy(&mount->reaper_cond);
+	pthread_mutex_destroy(&mount->reaper_lock);
+}
+
+int xbfs_mount_use(struct xbfs_mount *mount, struct xbfsfile *xbfs)
+{
+	int fd, ret, loaded = 0;
+
+	// a single image is loaded for the whole mount
+	if (!mount->multi)
+		return 0;
+
+	pthread_mutex_lock(&xbfs->lock);
+	if (!xbfs->image) {
+		if (xbfs->broken) {
+			pthread_mutex_unlock(&xbfs->lock);
+			return -EIO;
+		}
+		if (!quiet)
+			fprintf(stderr, "loading image %s\n", xbfs->path);
+		fd = open(xbfs->path, O_RDONLY);
+		ret = (fd < 0) ? -errno :
+			xbfs_open_image(xbfs, fd, xbfs->path, mount->cache);
+		if (ret) {
+			if (fd < 0)
+				perror(xbfs->path);
+			// don't parse a bad file on every access, but errors
+			// like running out of descriptors or memory may pass
+			if (ret == -EINVAL || ret == -ENOTSUP)
+				__atomic_store_n(&xbfs->broken, 1,
+						 __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&xbfs->lock);
+			return -EIO;
+		}
+		loaded = 1;
+	}
+	xbfs->users++;
+	pthread_mutex_unlock(&xbfs->lock);
+
+	// let the reaper check the memory limit right away
+	if (loaded && mount->reaping && xbfs_options.memory_bytes) {
+		pthread_mutex_lock(&mount->reaper_lock);
+		pthread_cond_signal(&mount->reaper_cond);
+		pthread_mutex_unlock(&mount->reaper_lock);
+	}
+
+	return 0;
+}
+
+void xbfs_mount_unuse(struct xbfs_mount *mount, struct xbfsfile *xbfs)
+{
+	if (!mount->multi)
+		return;
+
+	pthread_mutex_lock(&xbfs->lock);
+	if (!--xbfs->users)
+		xbfs->last_used = xbfs_now();
+	pthread_mutex_unlock(&xbfs->lock);
+}
+
+void xbfs_mount_lookup(struct xbfs_mount *mount, struct xbfsfile *xbfs,
+		       long long count)
+{
+	if (!mount->multi)
+		return;
+
+	pthread_mutex_lock(&xbfs->lock);
+	xbfs->nlookup += count;
+	// the idle time counts from the last forget too
+	if (!xbfs->nlookup && !xbfs->users)
+		xbfs->last_used = xbfs_now();
+	pthread_mutex_unlock(&xbfs->lock);
+}
+
+struct xbfs_mount *xbfs_mount_load(int fd, const char *path)
+{
+	struct xbfs_mount *mount;
+
+	mount = (struct xbfs_mount *)calloc(1, sizeof(struct xbfs_mount));
+	if (!mount) {
+		fprintf(stderr, "not enough memory\n");
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	mount->timestamp = time(NULL);
+
+	// one cache for all images, so its size is a budget for the
+	// whole mount
+	if (xbfs_options.cache_bytes) {
+		if (xbfs_options.cache_bytes <= SIZE_MAX)
+			mount->cache = block_cache_new(xbfs_options.cache_bytes,
+						       IMAGE_CACHE_BLOCK_SIZE);
+		if (mount->cache)
+			fprintf(stderr, "using %llu byte block cache\n",
+				xbfs_options.cache_bytes);
+		else
+			fprintf(stderr, "cannot allocate block cache\n");
+	}
+
+	if (fd >= 0) {
+		mount->images = (struct xbfsfile **)malloc(
+			sizeof(struct xbfsfile *));
+		if (mount->images)
+			mount->images[0] = xbfs_load(fd, path, mount->cache);
+		else
+			close(fd);
+		if (!mount->images || !mount->images[0]) {
+			xbfs_mount_unload(mount);
+			return NULL;
+		}
+		mount->nimages = 1;
+	} else {
+		mount->multi = 1;
+		if (xbfs_mount_scan(mount, path)) {
+			xbfs_mount_unload(mount);
+			return NULL;
+		}
+	}
+
+	return mount;
+}
+
+void xbfs_mount_unload(struct xbfs_mount *mount)
+{
+	unsigned long long hits, misses;
+	int i;
+
+	if (!mount)
+		return;
+
+	xbfs_mount_stop(mount);
+
+	for (i = 0; i < mount->nimages; i++)
+		xbfs_unload(mount->images[i]);
+	free(mount->images);
+
+	if (mount->cache) {
+		block_cache_stats(mount->cache, &hits, &misses);
+		if (!quiet)
+			fprintf(stderr, "block cache: %llu hits, %llu misses\n",
+				hits, misses);
+		block_cache_free(mount->cache);
+	}
+
+	free(mount);
+}
+
+struct xbfsfile *xbfs_mount_find(struct xbfs_mount *mount, const char *name,
+				 size_t length)
 {
-	struct xbfsfile *xbfs = (struct xbfsfile *)context;
+	int low = 0, high = mount->nimages - 1, mid, cmp;
+	const char *image;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		image = mount->images[mid]->name;
+		cmp = strncmp(image, name, length);
+		if (!cmp && image[length])
+			cmp = 1;
+		if (!cmp)
+			return xbfs_mount_listed(mount->images[mid]) ?
+				mount->images[mid] : NULL;
+		if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	return NULL;
+}
 
+void xbfs_mount_stat(struct xbfs_mount *mount, struct xbfsfile *xbfs,
+		     struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR |
+		S_IXGRP | S_IXOTH;
 	if (xbfs) {
-		close(xbfs->fd);
-		tree_free(xbfs->tree);
-		free(xbfs);
+		// the number of subdirectories is not known before the
+		// image is loaded, 1 tells that to tools like find
+		stbuf->st_nlink = 1;
+		stbuf->st_atime = xbfs->mtime;
+		stbuf->st_mtime = xbfs->mtime;
+		stbuf->st_ctime = xbfs->mtime;
+		return;
 	}
+	// every image is a subdirectory
+	stbuf->st_nlink = 2 + mount->nimages;
+	stbuf->st_atime = mount->timestamp;
+	stbuf->st_mtime = mount->timestamp;
+	stbuf->st_ctime = mount->timestamp;
+}
+
+/*!
+ * \brief Initialize filesystem.
+ */
+static void *xbfs_init(struct fuse_conn_info *conn)
+{
+	struct xbfs_mount *mount = xbfs_mount_load(xbfs_fd, xbfs_path);
+
+	if (!mount || xbfs_mount_start(mount))
+		fuse_exit(fuse_get_context()->fuse);
+
+#ifdef HAVE_FUSE_READ_BUF
+	// let the kernel take data from the image file through a pipe
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE |
+				       FUSE_CAP_SPLICE_MOVE);
+#endif
+
+	return (void *)mount;
+}
+
+/*!
+ * \brief Clean up filesystem.
+ */
+static void xbfs_destroy(void *context)
+{
+	xbfs_mount_unload((struct xbfs_mount *)context);
 }
 
 /*!
@@ -321,8 +1620,13 @@ struct fuse_operations xbfs_operations = {
 	.getattr = xbfs_getattr,
 	.open = xbfs_open,
 	.read = xbfs_read,
+#ifdef HAVE_FUSE_READ_BUF
+	.read_buf = xbfs_read_buf,
+#endif
+	.release = xbfs_release,
 	.opendir = xbfs_opendir,
 	.readdir = xbfs_readdir,
+	.releasedir = xbfs_releasedir,
 	.init = xbfs_init,
 	.destroy = xbfs_destroy,
 };
@@ -38,29 +38,33 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include "image.h"
+
 /*!
  * \brief Basic information about one XBFS file.
 
  * This structure contains basic information about one XBFS file,
- * including information needed by FUSE system. It is stored as \c
- * private_data of FUSE context.
+ * including information needed by FUSE system. It is stored in the
+ * \c xbfs_mount it belongs to.
  */
 struct xbfsfile {
 	/*!
-	 * \brief XBFS file descriptor.
+	 * \brief Name of the image subdirectory in a multi-image mount.
+	 */
+	char *name;
+
+	/*!
+	 * \brief Timestamp of the filesystem.
 	 */
-	int fd;
+	time_t timestamp;
 
 	/*!
-	 * \brief Disk operations mutex.
+	 * \brief XBFS image.
 	 *
-	 * This mutex is used to synchronize disk operations on XBFS
-	 * file.  Whenever one need to read/write/lseek XBFS file, this
-	 * mutex should be locked with \c pthread_mutex_lock(). After
-	 * operation has finished (also after an error), this mutex
-	 * should be unlocked with \c pthread_mutex_unlock().
+	 * Image backends are safe to use from many threads without
+	 * locking.
 	 */
-	pthread_mutex_t mutex;
+	struct image *image;
 
 	/*!
 	 * \brief Size of the XBFS file.
@@ -70,17 +74,397 @@ struct xbfsfile {
 	/*!
 	 * \brief Directory tree of the XBFS file.
 	 *
-	 * This field contains directory tree of the XBFS file (which
-	 * doesn't constain any directories, only files). This is
-	 * filled by \c xbfs_init().
+	 * This field contains directory tree of the XBFS file. It is
+	 * filled by \c xbfs_load(), or on demand in lazy mode.
 	 */
 	struct tree *tree;
+
+	/*!
+	 * \brief Offset of the XDVDFS filesystem inside of the image.
+	 *
+	 * This is not known (zero) when the tree comes from the tree
+	 * cache.
+	 */
+	off_t base_offset;
+
+	/*!
+	 * \brief Full path index of \c tree.
+	 *
+	 * This is built by \c xbfs_load() once the tree is complete.
+	 * It is NULL in lazy mode (or when there was not enough
+	 * memory), then lookups walk the tree.
+	 */
+	struct tree_index *index;
+
+	/*!
+	 * \brief Path of the image file in a multi-image mount.
+	 *
+	 * Images of a multi-image mount are opened on first use and
+	 * closed again when they are evicted, see \c xbfs_mount_use().
+	 */
+	char *path;
+
+	/*!
+	 * \brief Modification time of the image file in a multi-image
+	 * mount, used for the image subdirectory.
+	 */
+	time_t mtime;
+
+	/*!
+	 * \brief Mutex protecting loading and eviction of the image and
+	 * the fields below.
+	 */
+	pthread_mutex_t lock;
+
+	/*!
+	 * \brief Number of operations, open files and open directories
+	 * using \c image and \c tree.
+	 */
+	int users;
+
+	/*!
+	 * \brief Number of lookups of tree nodes the kernel still
+	 * remembers (low-level frontend only).
+	 */
+	unsigned long long nlookup;
+
+	/*!
+	 * \brief Monotonic time in seconds when \c users dropped to zero.
+	 */
+	time_t last_used;
+
+	/*!
+	 * \brief Memory used by \c tree, \c index and \c image, updated
+	 * by the reaper.
+	 */
+	size_t memory;
+
+	/*!
+	 * \brief Flag indicating that the file is not an image that can be
+	 * read, so it is not tried again. Other errors, e.g. running out
+	 * of file descriptors, don't set it.
+	 */
+	int broken;
+};
+
+/*!
+ * \brief Images served by one FUSE mount.
+ *
+ * This is stored as \c private_data of FUSE context. A mount serves
+ * either one image at the top directory, or every image found in a
+ * directory as a subdirectory named after the image file.
+ */
+struct xbfs_mount {
+	/*!
+	 * \brief Images, sorted by name.
+	 */
+	struct xbfsfile **images;
+
+	/*!
+	 * \brief Number of \c images.
+	 */
+	int nimages;
+
+	/*!
+	 * \brief Flag indicating that images appear as subdirectories.
+	 */
+	int multi;
+
+	/*!
+	 * \brief Block cache shared by all images, NULL if disabled.
+	 */
+	struct block_cache *cache;
+
+	/*!
+	 * \brief Mount time, used as timestamp of the top directory.
+	 */
+	time_t timestamp;
+
+	/*!
+	 * \brief Flag indicating that the reaper thread is running.
+	 */
+	int reaping;
+
+	/*!
+	 * \brief Reaper thread evicting idle images.
+	 */
+	pthread_t reaper;
+
+	/*!
+	 * \brief Mutex protecting \c reaping, used with \c reaper_cond.
+	 */
+	pthread_mutex_t reaper_lock;
+
+	/*!
+	 * \brief Condition waking the reaper early (to stop, or to check
+	 * the memory limit after an image has been loaded).
+	 */
+	pthread_cond_t reaper_cond;
+
+	/*!
+	 * \brief Function called by the reaper for idle images which
+	 * cannot be evicted because the kernel still knows some of
+	 * their inodes; it may ask the kernel to forget them. May be
+	 * NULL.
+	 */
+	void (*idle)(struct xbfs_mount *mount, struct xbfsfile *xbfs);
+
+	/*!
+	 * \brief Data for \c idle.
+	 */
+	void *idle_data;
+};
+
+/*!
+ * \brief Default of all cache timeouts; images never change, so this
+ * is just a very long time.
+ */
+#define XBFS_TIMEOUT_FOREVER (365.0 * 24 * 60 * 60)
+
+/*!
+ * \brief Default number of seconds after which unused images of a
+ * multi-image mount are closed.
+ */
+#define XBFS_IDLE_TIMEOUT 300
+
+/*!
+ * \brief Options of the filesystem.
+ *
+ * These are filled by the main program from the "-o" options before
+ * FUSE is started.
+ */
+struct xbfs_options {
+	/*!
+	 * \brief Name of the image backend, NULL for the default.
+	 */
+	char *backend;
+
+	/*!
+	 * \brief Use the low-level (inode based) FUSE frontend.
+	 */
+	int lowlevel;
+
+	/*!
+	 * \brief Load directories on first use instead of at mount time.
+	 */
+	int lazy;
+
+	/*!
+	 * \brief Directory of the tree cache, NULL if it is not used.
+	 */
+	char *index_cache;
+
+	/*!
+	 * \brief Number of threads loading directory tables at mount.
+	 */
+	int load_threads;
+
+	/*!
+	 * \brief Size of the image block cache as given by the user.
+	 */
+	char *cache_size;
+
+	/*!
+	 * \brief Size of the image block cache in bytes, 0 if disabled.
+	 */
+	unsigned long long cache_bytes;
+
+	/*!
+	 * \brief Seconds the kernel may cache names.
+	 */
+	double entry_timeout;
+
+	/*!
+	 * \brief Seconds the kernel may cache attributes.
+	 */
+	double attr_timeout;
+
+	/*!
+	 * \brief Seconds the kernel may cache failed lookups.
+	 */
+	double negative_timeout;
+
+	/*!
+	 * \brief Flag indicating that file data are cached across opens.
+	 */
+	int keep_cache;
+
+	/*!
+	 * \brief Seconds after which an unused image of a multi-image
+	 * mount is closed, 0 to keep images open.
+	 */
+	int idle_timeout;
+
+	/*!
+	 * \brief Limit of memory used by directory trees as given by the
+	 * user.
+	 */
+	char *memory_limit;
+
+	/*!
+	 * \brief Limit of memory used by directory trees (and compressed
+	 * image indexes and caches) of a multi-image mount in bytes, 0 if
+	 * unlimited.
+	 */
+	unsigned long long memory_bytes;
 };
 
+struct fuse_args;
+
 extern struct fuse_operations xbfs_operations;
 
+extern struct xbfs_options xbfs_options;
+
+/*!
+ * \brief Open XBFS image and build its directory tree.
+ *
+ * If the tree cache is enabled, the tree is taken from there when the
+ * image hasn't changed, and stored there after it has been built.
+ *
+ * \param fd file descriptor of the image, it is owned by the returned
+ * structure afterwards (also on failure).
+ * \param path path of the image, used to identify it in the tree
+ * cache; may be NULL.
+ * \param cache block cache to read the image through, may be NULL.
+ * \return new \c xbfsfile structure or NULL on failure.
+ */
+struct xbfsfile *xbfs_load(int fd, const char *path,
+			   struct block_cache *cache);
+
+/*!
+ * \brief Close XBFS image and free its directory tree.
+ *
+ * \param xbfs structure returned by \c xbfs_load(), may be NULL.
+ */
+void xbfs_unload(struct xbfsfile *xbfs);
+
+/*!
+ * \brief Load images to be served by one mount.
+ *
+ * A single image is loaded right away. For a directory only a catalog
+ * of the image files is built; the images are loaded by
+ * \c xbfs_mount_use().
+ *
+ * \param fd file descriptor of a single image (owned by the mount
+ * afterwards), or -1 to serve all images in a directory.
+ * \param path absolute path of the image or of the directory.
+ * \return new \c xbfs_mount structure or NULL on failure.
+ */
+struct xbfs_mount *xbfs_mount_load(int fd, const char *path);
+
+/*!
+ * \brief Start the reaper thread of a multi-image mount.
+ *
+ * The reaper closes images which have not been used for
+ * \c idle_timeout seconds, and the least recently used ones when
+ * their trees need more than \c memory_limit. Nothing is started if
+ * neither is set. This has to be called after FUSE went to background.
+ *
+ * \param mount the mount.
+ * \return 0 on success, -1 if the thread cannot be started.
+ */
+int xbfs_mount_start(struct xbfs_mount *mount);
+
+/*!
+ * \brief Stop the reaper thread, if it is running.
+ *
+ * \param mount the mount.
+ */
+void xbfs_mount_stop(struct xbfs_mount *mount);
+
+/*!
+ * \brief Unload all images of a mount and free it.
+ *
+ * \param mount structure returned by \c xbfs_mount_load(), may be NULL.
+ */
+void xbfs_mount_unload(struct xbfs_mount *mount);
+
+/*!
+ * \brief Start using an image, loading it if needed.
+ *
+ * The image and its tree stay loaded until the matching
+ * \c xbfs_mount_unuse().
+ *
+ * \param mount the mount.
+ * \param xbfs image of the mount.
+ * \return 0 on success or -errno if the image cannot be loaded.
+ */
+int xbfs_mount_use(struct xbfs_mount *mount, struct xbfsfile *xbfs);
+
+/*!
+ * \brief Stop using an image.
+ *
+ * \param mount the mount.
+ * \param xbfs image given to \c xbfs_mount_use().
+ */
+void xbfs_mount_unuse(struct xbfs_mount *mount, struct xbfsfile *xbfs);
+
+/*!
+ * \brief Count lookups of tree nodes remembered by the kernel.
+ *
+ * Images with remembered nodes are never evicted, as the nodes are
+ * their inode numbers.
+ *
+ * \param mount the mount.
+ * \param xbfs image the nodes belong to, it must be in use or have
+ * remembered nodes.
+ * \param count number of new lookups, negative for forgotten ones.
+ */
+void xbfs_mount_lookup(struct xbfs_mount *mount, struct xbfsfile *xbfs,
+		       long long count);
+
+/*!
+ * \brief Find image of a multi-image mount by its name.
+ *
+ * \param mount mount to search.
+ * \param name image name, not necessarily zero terminated.
+ * \param length length of \c name.
+ * \return image or NULL if there is no such image (or it is not
+ * listed, see \c xbfs_mount_listed()).
+ */
+struct xbfsfile *xbfs_mount_find(struct xbfs_mount *mount, const char *name,
+				 size_t length);
+
+/*!
+ * \brief Check if an image is shown in the top directory of a
+ * multi-image mount.
+ *
+ * Images found not to be readable (see \c xbfsfile::broken) are left
+ * out.
+ */
+static inline int xbfs_mount_listed(struct xbfsfile *xbfs)
+{
+	return !__atomic_load_n(&xbfs->broken, __ATOMIC_RELAXED);
+}
+
+/*!
+ * \brief Get attributes of the top directory of a multi-image mount
+ * or of one of its image subdirectories.
+ *
+ * Image subdirectories are described from the catalog, so the image
+ * doesn't have to be loaded.
+ *
+ * \param mount the mount.
+ * \param xbfs image, or NULL for the top directory.
+ * \param stbuf stats will be stored here.
+ */
+void xbfs_mount_stat(struct xbfs_mount *mount, struct xbfsfile *xbfs,
+		     struct stat *stbuf);
+
+/*!
+ * \brief Mount and serve \c xbfs_fd with the low-level FUSE frontend.
+ *
+ * \param args FUSE command line arguments (without xbfuse options).
+ * \return program exit status.
+ */
+int xbfs_lowlevel_main(struct fuse_args *args);
+
 extern int xbfs_fd;
 
+extern char *xbfs_path;
+
+extern int quiet;
+
 //! Treat given memory address as a 16-bit big-endian integer.
 #define BE_16(x)  ((((uint8_t*)(x))[0] << 8) | ((uint8_t*)(x))[1])
 
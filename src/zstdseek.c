@@ -0,0 +1,649 @@
+/*
+ *  Copyright (C) 2006 Mike Melanson (mike at multimedia.cx)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*!
+ * \file zstdseek.c
+ * \author Mike Melanson
+ * \brief Backend for seekable zstd images.
+ *
+ * A seekable zstd file is a sequence of independent zstd frames
+ * followed by a skippable frame holding the seek table: the compressed
+ * and decompressed size of every frame, optionally a checksum, and a
+ * footer with the number of frames, a descriptor byte and a magic
+ * number. The image offset of any byte is found by a binary search of
+ * the frame offsets, and only the frames a read overlaps are
+ * decompressed.
+ *
+ * Decompressed frames are kept in a small cache of whole frames, whose
+ * buffers are allocated on first use. Frames a read or the read-ahead
+ * will need next are handed to worker threads, which decompress them
+ * in parallel with the reader.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_ZSTD
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <zstd.h>
+
+#include "image.h"
+
+// magic number of zstd frames, the image has to start with one
+#define ZSTDSEEK_FRAME_MAGIC 0xFD2FB528u
+
+// magic number of the skippable frame holding the seek table
+#define ZSTDSEEK_SKIPPABLE_MAGIC 0x184D2A5Eu
+
+// magic number at the very end of the file
+#define ZSTDSEEK_SEEKABLE_MAGIC 0x8F92EAB1u
+
+// size of the seek table footer
+#define ZSTDSEEK_FOOTER_SIZE 9
+
+// descriptor bit telling that seek table entries have a checksum
+#define ZSTDSEEK_CHECKSUM_FLAG 0x80
+
+// memory for decompressed frames of one image
+#define ZSTDSEEK_CACHE_SIZE (16 * 1024 * 1024)
+
+// fewest cached frames, whatever their size: one being read and one
+// being decompressed by a worker
+#define ZSTDSEEK_CACHE_MIN 2
+
+// largest decompressed frame accepted, so that the cache stays within
+// ZSTDSEEK_CACHE_SIZE
+#define ZSTDSEEK_FRAME_MAX (ZSTDSEEK_CACHE_SIZE / ZSTDSEEK_CACHE_MIN)
+
+// most worker threads of one image
+#define ZSTDSEEK_WORKERS_MAX 4
+
+// size of the queue of frames waiting for workers
+#define ZSTDSEEK_QUEUE 64
+
+//! Treat given memory address as a 32-bit little-endian integer.
+#define ZSTDSEEK_LE_32(x) ((uint32_t)(x)[0] | ((uint32_t)(x)[1] << 8) | \
+			   ((uint32_t)(x)[2] << 16) | \
+			   ((uint32_t)(x)[3] << 24))
+
+enum zstdseek_state {
+	ZSTDSEEK_EMPTY,
+	ZSTDSEEK_LOADING,
+	ZSTDSEEK_READY,
+};
+
+// One decompressed frame of the cache.
+struct zstdseek_slot {
+	enum zstdseek_state state;
+	//! Cached frame, undefined in empty slots.
+	uint32_t frame;
+	//! Number of readers copying from \c data.
+	int refs;
+	//! Value of the use counter at the last use, for LRU.
+	unsigned long long used;
+	//! Decompressed frame, as large as the largest frame; NULL until
+	//! the slot is first filled.
+	char *data;
+};
+
+struct zstdseek {
+	//! Number of frames.
+	uint32_t nframes;
+	//! Decompressed offsets of the frames, \c nframes + 1 entries.
+	uint64_t *offsets;
+	//! File offsets of the frames, \c nframes + 1 entries.
+	uint64_t *positions;
+	//! Size of the largest decompressed frame.
+	size_t frame_max;
+
+	//! Protects everything below.
+	pthread_mutex_t lock;
+	//! Signalled when a slot becomes ready or free, or a job is queued.
+	pthread_cond_t cond;
+	//! Frame cache.
+	struct zstdseek_slot *slots;
+	//! Number of \c slots.
+	int nslots;
+	//! Number of \c slots with \c data allocated.
+	int nallocated;
+	//! Use counter.
+	unsigned long long clock;
+
+	//! Frames waiting for workers, a ring.
+	uint32_t queue[ZSTDSEEK_QUEUE];
+	//! Index of the first queued frame.
+	int head;
+	//! Number of queued frames.
+	int queued;
+	//! Worker threads, started on first use.
+	pthread_t workers[ZSTDSEEK_WORKERS_MAX];
+	//! Number of started \c workers.
+	int nworkers;
+	//! Flag telling workers to exit.
+	int stop;
+};
+
+// Decompression state of one thread.
+struct zstdseek_thread {
+	ZSTD_DCtx *dctx;
+	//! Compressed frame being decompressed, reused for every frame.
+	char *in;
+	//! Size of \c in.
+	size_t in_size;
+};
+
+static pthread_key_t zstdseek_key;
+static pthread_once_t zstdseek_once = PTHREAD_ONCE_INIT;
+
+static void zstdseek_destroy(void *data)
+{
+	struct zstdseek_thread *thread = (struct zstdseek_thread *)data;
+
+	ZSTD_freeDCtx(thread->dctx);
+	free(thread->in);
+	free(thread);
+}
+
+static void zstdseek_init_key(void)
+{
+	pthread_key_create(&zstdseek_key, zstdseek_destroy);
+}
+
+// Decompress one frame into out, which holds frame_max bytes. Every
+// thread keeps its own decompression context and input buffer.
+static int zstdseek_decompress(struct image *image, uint32_t frame, char *out)
+{
+	struct zstdseek *zs = (struct zstdseek *)image->priv;
+	struct zstdseek_thread *thread;
+	uint64_t pos = zs->positions[frame];
+	size_t len = zs->positions[frame + 1] - pos;
+	size_t size = zs->offsets[frame + 1] - zs->offsets[frame];
+	ssize_t ret;
+	size_t got;
+	char *in;
+
+	pthread_once(&zstdseek_once, zstdseek_init_key);
+	thread = (struct zstdseek_thread *)pthread_getspecific(zstdseek_key);
+	if (!thread) {
+		thread = (struct zstdseek_thread *)calloc(1,
+			sizeof(struct zstdseek_thread));
+		if (!thread)
+			return -ENOMEM;
+		thread->dctx = ZSTD_createDCtx();
+		if (!thread->dctx) {
+			free(thread);
+			return -ENOMEM;
+		}
+		pthread_setspecific(zstdseek_key, thread);
+	}
+
+	if (len > thread->in_size) {
+		in = (char *)realloc(thread->in, len);
+		if (!in)
+			return -ENOMEM;
+		thread->in = in;
+		thread->in_size = len;
+	}
+
+	ret = image_pread(image->fd, thread->in, len, pos);
+	if (ret >= 0 && (size_t)ret < len)
+		ret = -EIO;
+	if (ret >= 0) {
+		got = ZSTD_decompressDCtx(thread->dctx, out, zs->frame_max,
+					  thread->in, len);
+		ret = (ZSTD_isError(got) || got != size) ? -EIO : 0;
+	}
+
+	return ret;
+}
+
+// Find slot holding given frame, the lock must be held.
+static struct zstdseek_slot *zstdseek_find(struct zstdseek *zs,
+					   uint32_t frame)
+{
+	int i;
+
+	for (i = 0; i < zs->nslots; i++)
+		if (zs->slots[i].state != ZSTDSEEK_EMPTY &&
+		    zs->slots[i].frame == frame)
+			return &zs->slots[i];
+
+	return NULL;
+}
+
+// Take the least recently used slot nobody is using, the lock must be
+// held. Returns NULL if all slots are busy.
+static struct zstdseek_slot *zstdseek_victim(struct zstdseek *zs)
+{
+	struct zstdseek_slot *slot, *victim = NULL;
+	int i;
+
+	for (i = 0; i < zs->nslots; i++) {
+		slot = &zs->slots[i];
+		if (slot->state == ZSTDSEEK_EMPTY)
+			return slot;
+		if (slot->state == ZSTDSEEK_READY && !slot->refs &&
+		    (!victim || slot->used < victim->used))
+			victim = slot;
+	}
+
+	return victim;
+}
+
+// Decompress a frame into a claimed slot and publish it; the lock must
+// be held and is dropped meanwhile.
+static int zstdseek_fill(struct image *image, struct zstdseek_slot *slot,
+			 uint32_t frame)
+{
+	struct zstdseek *zs = (struct zstdseek *)image->priv;
+	char *data = slot->data;
+	int ret;
+
+	slot->state = ZSTDSEEK_LOADING;
+	slot->frame = frame;
+	slot->used = ++zs->clock;
+	pthread_mutex_unlock(&zs->lock);
+
+	// nobody else touches the slot while it is loading
+	if (!data)
+		data = (char *)malloc(zs->frame_max);
+	ret = data ? zstdseek_decompress(image, frame, data) : -ENOMEM;
+
+	pthread_mutex_lock(&zs->lock);
+	if (data && !slot->data) {
+		slot->data = data;
+		zs->nallocated++;
+	}
+	// a failed frame is not kept, the next reader tries again
+	slot->state = ret ? ZSTDSEEK_EMPTY : ZSTDSEEK_READY;
+	pthread_cond_broadcast(&zs->cond);
+
+	return ret;
+}
+
+// Get a frame from the cache, decompressing it if needed; the slot is
+// referenced until zstdseek_put(). The lock must be held.
+static int zstdseek_get(struct image *image, uint32_t frame,
+			struct zstdseek_slot **slotp)
+{
+	struct zstdseek *zs = (struct zstdseek *)image->priv;
+	struct zstdseek_slot *slot;
+	int ret;
+
+	for (;;) {
+		slot = zstdseek_find(zs, frame);
+		if (slot && slot->state == ZSTDSEEK_READY)
+			break;
+		if (!slot) {
+			slot = zstdseek_victim(zs);
+			if (slot) {
+				// referenced before anyone can evict it
+				slot->refs++;
+				ret = zstdseek_fill(image, slot, frame);
+				if (ret) {
+					slot->refs--;
+					return ret;
+				}
+				*slotp = slot;
+				return 0;
+			}
+		}
+		// being decompressed by someone else, or no free slot
+		pthread_cond_wait(&zs->cond, &zs->lock);
+	}
+
+	slot->refs++;
+	slot->used = ++zs->clock;
+	*slotp = slot;
+
+	return 0;
+}
+
+// Release a slot taken by zstdseek_get(), the lock must be held.
+static void zstdseek_put(struct zstdseek *zs, struct zstdseek_slot *slot)
+{
+	if (!--slot->refs)
+		pthread_cond_broadcast(&zs->cond);
+}
+
+static void *zstdseek_worker(void *data)
+{
+	struct image *image = (struct image *)data;
+	struct zstdseek *zs = (struct zstdseek *)image->priv;
+	struct zstdseek_slot *slot;
+	uint32_t frame;
+
+	pthread_mutex_lock(&zs->lock);
+	for (;;) {
+		while (!zs->queued && !zs->stop)
+			pthread_cond_wait(&zs->cond, &zs->lock);
+		if (zs->stop)
+			break;
+
+		frame = zs->queue[zs->head];
+		zs->head = (zs->head + 1) % ZSTDSEEK_QUEUE;
+		zs->queued--;
+
+		// skipped when cached already or all slots are busy, the
+		// reader gets it by itself then
+		if (zstdseek_find(zs, frame))
+			continue;
+		slot = zstdseek_victim(zs);
+		if (slot)
+			zstdseek_fill(image, slot, frame);
+	}
+	pthread_mutex_unlock(&zs->lock);
+
+	return NULL;
+}
+
+// Queue frames for the workers, starting them on first use; the lock
+// must be held. Only as many frames as the cache can hold besides the
+// ones being read are queued.
+static void zstdseek_queue(struct image *image, uint32_t first,
+			   uint32_t last)
+{
+	struct zstdseek *zs = (struct zstdseek *)image->priv;
+	long ncpus;
+	uint32_t frame;
+
+	if (!zs->nworkers && !zs->stop) {
+		// threads are not started at open, as the image may be
+		// opened before the process goes to background
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpus > ZSTDSEEK_WORKERS_MAX)
+			ncpus = ZSTDSEEK_WORKERS_MAX;
+		while (zs->nworkers < ncpus &&
+		       !pthread_create(&zs->workers[zs->nworkers], NULL,
+				       zstdseek_worker, image))
+			zs->nworkers++;
+		// don't try again and again
+		if (!zs->nworkers)
+			zs->stop = 1;
+	}
+	if (!zs->nworkers)
+		return;
+
+	if (last - first >= (uint32_t)zs->nslots / 2)
+		last = first + zs->nslots / 2 - 1;
+	for (frame = first; frame <= last; frame++) {
+		if (zs->queued == ZSTDSEEK_QUEUE)
+			break;
+		if (zstdseek_find(zs, frame))
+			continue;
+		zs->queue[(zs->head + zs->queued) % ZSTDSEEK_QUEUE] = frame;
+		zs->queued++;
+	}
+	pthread_cond_broadcast(&zs->cond);
+}
+
+// Find frame holding given image offset, which must be inside of the
+// image.
+static uint32_t zstdseek_frame(struct zstdseek *zs, uint64_t offset)
+{
+	uint32_t low = 0, high = zs->nframes - 1, mid;
+
+	// the last frame starting at or before offset; empty frames are
+	// skipped, as the next one starts at the same offset
+	while (low < high) {
+		mid = low + (high - low + 1) / 2;
+		if (zs->offsets[mid] <= offset)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	return low;
+}
+
+static int image_zstdseek_probe(const unsigned char *header, size_t size)
+{
+	return size >= 4 && ZSTDSEEK_LE_32(header) == ZSTDSEEK_FRAME_MAGIC;
+}
+
+// Read and check the seek table and fill the frame offsets.
+static int zstdseek_load_table(struct image *image, struct zstdseek *zs)
+{
+	unsigned char footer[ZSTDSEEK_FOOTER_SIZE], skip[8], *table, *entry;
+	uint64_t table_size, entry_size, start;
+	size_t in_max = ZSTD_compressBound(ZSTDSEEK_FRAME_MAX);
+	uint32_t i;
+	ssize_t ret;
+
+	if (image->size < ZSTDSEEK_FOOTER_SIZE + 8)
+		return -EINVAL;
+	ret = image_pread(image->fd, footer, sizeof(footer),
+			  image->size - ZSTDSEEK_FOOTER_SIZE);
+	if (ret < 0)
+		return ret;
+	// a plain zstd file can't be read at random offsets
+	if (ret < (ssize_t)sizeof(footer) ||
+	    ZSTDSEEK_LE_32(&footer[5]) != ZSTDSEEK_SEEKABLE_MAGIC)
+		return -EINVAL;
+
+	zs->nframes = ZSTDSEEK_LE_32(footer);
+	entry_size = (footer[4] & ZSTDSEEK_CHECKSUM_FLAG) ? 12 : 8;
+	table_size = zs->nframes * entry_size;
+	if (!zs->nframes ||
+	    table_size + ZSTDSEEK_FOOTER_SIZE + 8 > (uint64_t)image->size)
+		return -EINVAL;
+
+	start = image->size - ZSTDSEEK_FOOTER_SIZE - table_size - 8;
+	ret = image_pread(image->fd, skip, sizeof(skip), start);
+	if (ret >= 0 && (ret < (ssize_t)sizeof(skip) ||
+			 ZSTDSEEK_LE_32(skip) != ZSTDSEEK_SKIPPABLE_MAGIC ||
+			 ZSTDSEEK_LE_32(&skip[4]) !=
+			 table_size + ZSTDSEEK_FOOTER_SIZE))
+		ret = -EINVAL;
+	if (ret < 0)
+		return ret;
+
+	table = (unsigned char *)malloc(table_size);
+	zs->offsets = (uint64_t *)malloc((zs->nframes + 1) * sizeof(uint64_t));
+	zs->positions = (uint64_t *)malloc((zs->nframes + 1) *
+					   sizeof(uint64_t));
+	if (!table || !zs->offsets || !zs->positions) {
+		free(table);
+		return -ENOMEM;
+	}
+	ret = image_pread(image->fd, table, table_size, start + 8);
+	if (ret >= 0 && (uint64_t)ret < table_size)
+		ret = -EINVAL;
+	if (ret < 0) {
+		free(table);
+		return ret;
+	}
+
+	zs->offsets[0] = 0;
+	zs->positions[0] = 0;
+	for (i = 0; i < zs->nframes; i++) {
+		entry = table + i * entry_size;
+		zs->positions[i + 1] = zs->positions[i] + ZSTDSEEK_LE_32(entry);
+		zs->offsets[i + 1] = zs->offsets[i] +
+			ZSTDSEEK_LE_32(&entry[4]);
+		if (ZSTDSEEK_LE_32(&entry[4]) > zs->frame_max)
+			zs->frame_max = ZSTDSEEK_LE_32(&entry[4]);
+		// this bounds the input buffer of every thread
+		if (ZSTDSEEK_LE_32(entry) > in_max) {
+			free(table);
+			return -EINVAL;
+		}
+	}
+	free(table);
+
+	// the frames have to end where the seek table starts
+	if (zs->positions[zs->nframes] != start || !zs->frame_max ||
+	    zs->frame_max > ZSTDSEEK_FRAME_MAX)
+		return -EINVAL;
+
+	image->size = zs->offsets[zs->nframes];
+
+	return 0;
+}
+
+static void image_zstdseek_close(struct image *image);
+
+static int image_zstdseek_open(struct image *image)
+{
+	struct zstdseek *zs;
+	int ret;
+
+	zs = (struct zstdseek *)calloc(1, sizeof(struct zstdseek));
+	if (!zs)
+		return -ENOMEM;
+	pthread_mutex_init(&zs->lock, NULL);
+	pthread_cond_init(&zs->cond, NULL);
+	image->priv = zs;
+
+	ret = zstdseek_load_table(image, zs);
+	if (ret) {
+		image_zstdseek_close(image);
+		return ret;
+	}
+
+	zs->nslots = ZSTDSEEK_CACHE_SIZE / zs->frame_max;
+	if (zs->nslots < ZSTDSEEK_CACHE_MIN)
+		zs->nslots = ZSTDSEEK_CACHE_MIN;
+	zs->slots = (struct zstdseek_slot *)calloc(zs->nslots,
+						   sizeof(struct zstdseek_slot));
+	if (!zs->slots) {
+		image_zstdseek_close(image);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static ssize_t image_zstdseek_read(struct image *image, void *buf,
+				   size_t size, off_t offset)
+{
+	struct zstdseek *zs = (struct zstdseek *)image->priv;
+	struct zstdseek_slot *slot;
+	uint32_t frame, last;
+	size_t done = 0, within, want;
+	int ret = 0;
+
+	if (offset >= image->size)
+		return 0;
+	if (offset + size > image->size)
+		size = image->size - offset;
+	if (!size)
+		return 0;
+
+	frame = zstdseek_frame(zs, offset);
+	last = zstdseek_frame(zs, offset + size - 1);
+
+	pthread_mutex_lock(&zs->lock);
+	// the workers decompress the following frames meanwhile
+	if (last > frame)
+		zstdseek_queue(image, frame + 1, last);
+
+	for (; done < size; frame++) {
+		within = offset + done - zs->offsets[frame];
+		want = zs->offsets[frame + 1] - zs->offsets[frame] - within;
+		if (want > size - done)
+			want = size - done;
+		if (!want)
+			continue;
+
+		ret = zstdseek_get(image, frame, &slot);
+		if (ret)
+			break;
+		// the slot can't be evicted while referenced
+		pthread_mutex_unlock(&zs->lock);
+		memcpy((char *)buf + done, slot->data + within, want);
+		pthread_mutex_lock(&zs->lock);
+		zstdseek_put(zs, slot);
+		done += want;
+	}
+	pthread_mutex_unlock(&zs->lock);
+
+	return (done || !ret) ? (ssize_t)done : ret;
+}
+
+static void image_zstdseek_prefetch(struct image *image, off_t offset,
+				    off_t size)
+{
+	struct zstdseek *zs = (struct zstdseek *)image->priv;
+
+	if (offset >= image->size || size <= 0)
+		return;
+	if (offset + size > image->size)
+		size = image->size - offset;
+
+	pthread_mutex_lock(&zs->lock);
+	zstdseek_queue(image, zstdseek_frame(zs, offset),
+		       zstdseek_frame(zs, offset + size - 1));
+	pthread_mutex_unlock(&zs->lock);
+}
+
+static size_t image_zstdseek_memory(struct image *image)
+{
+	struct zstdseek *zs = (struct zstdseek *)image->priv;
+	size_t size;
+
+	size = sizeof(struct zstdseek) + 2 * ((size_t)zs->nframes + 1) *
+		sizeof(uint64_t) + zs->nslots * sizeof(struct zstdseek_slot);
+	pthread_mutex_lock(&zs->lock);
+	size += (size_t)zs->nallocated * zs->frame_max;
+	pthread_mutex_unlock(&zs->lock);
+
+	return size;
+}
+
+static void image_zstdseek_close(struct image *image)
+{
+	struct zstdseek *zs = (struct zstdseek *)image->priv;
+	int i;
+
+	pthread_mutex_lock(&zs->lock);
+	zs->stop = 1;
+	pthread_cond_broadcast(&zs->cond);
+	pthread_mutex_unlock(&zs->lock);
+	for (i = 0; i < zs->nworkers; i++)
+		pthread_join(zs->workers[i], NULL);
+
+	if (zs->slots)
+		for (i = 0; i < zs->nslots; i++)
+			free(zs->slots[i].data);
+	free(zs->slots);
+	free(zs->offsets);
+	free(zs->positions);
+	pthread_cond_destroy(&zs->cond);
+	pthread_mutex_destroy(&zs->lock);
+	free(zs);
+	image->priv = NULL;
+}
+
+const struct image_backend image_zstdseek_backend = {
+	.name = "zstd",
+	.probe = image_zstdseek_probe,
+	.open = image_zstdseek_open,
+	.read = image_zstdseek_read,
+	.prefetch = image_zstdseek_prefetch,
+	.memory = image_zstdseek_memory,
+	.close = image_zstdseek_close,
+};
+
+#endif				// HAVE_ZSTD